@@ -7,16 +7,79 @@ bool isContextActive()
     return context_active;
 }
 
-using std::unique_ptr;
-std::string loadFile(std::string fileName)
+// All program, VAO, texture and enable changes go through these,
+// so redundant ones are skipped. Deleted objects have to be forgotten,
+// since GL reuses their names.
+static GLState gl_state;
+
+bool cached(bool unchanged)
 {
-    auto fileStream = std::ifstream(fileName);
-    std::stringstream string_stream;
-    string_stream << fileStream.rdbuf();
-    std::string contents = string_stream.str();
-    return contents;
+    if (unchanged) gl_state.counters.elided++;
+    else gl_state.counters.issued++;
+    return unchanged;
+}
+
+void useProgram(GLuint program)
+{
+    if (cached(gl_state.program == program)) return;
+    glUseProgram(program);
+    gl_state.program = program;
+}
+
+void bindVertexArray(GLuint vao)
+{
+    if (cached(gl_state.vertex_array == vao)) return;
+    glBindVertexArray(vao);
+    gl_state.vertex_array = vao;
+}
+
+void bindTexture(GLenum unit, GLenum target, GLuint texture)
+{
+    auto binding = gl_state.textures.find({unit, target});
+    if (cached(binding != gl_state.textures.end() && binding->second == texture)) return;
+    if (gl_state.active_texture != unit)
+    {
+        glActiveTexture(unit);
+        gl_state.active_texture = unit;
+    }
+    glBindTexture(target, texture);
+    gl_state.textures[{unit, target}] = texture;
+}
+
+void setCapability(GLenum capability, bool enabled)
+{
+    auto current = gl_state.capabilities.find(capability);
+    if (cached(current != gl_state.capabilities.end() && current->second == enabled)) return;
+    if (enabled) glEnable(capability);
+    else glDisable(capability);
+    gl_state.capabilities[capability] = enabled;
+}
+
+void forgetProgram(GLuint program)
+{
+    if (gl_state.program == program) gl_state.program = 0;
+}
+
+void forgetVertexArray(GLuint vao)
+{
+    if (gl_state.vertex_array == vao) gl_state.vertex_array = 0;
+}
+
+void forgetTexture(GLuint texture)
+{
+    for (auto &binding : gl_state.textures)
+        if (binding.second == texture) binding.second = 0;
 }
 
+// Returns the counts since the last call and starts new ones.
+GLStateCounters takeStateCounters()
+{
+    GLStateCounters counters = gl_state.counters;
+    gl_state.counters = GLStateCounters();
+    return counters;
+}
+
+using std::unique_ptr;
 std::pair<std::string, std::string::iterator>
 parseToken(std::string::iterator begin, std::string::iterator end)
 {
@@ -38,6 +101,12 @@ bool contains(const std::map<T, U> &map, const T &key)
     return map.find(key) != map.end();
 }
 
+template <typename T, typename U>
+bool contains(const std::unordered_map<T, U> &map, const T &key)
+{
+    return map.find(key) != map.end();
+}
+
 bool contains(const std::string &str, char to_find)
 {
     return str.find(to_find) != std::string::npos;
@@ -54,16 +123,21 @@ void do_times(int times, std::function<void(int)> function)
     for (int i = 0; i < times; i++) function(i);
 }
 
-GLsizei vertexStride(const MeshData &mesh_data)
+GLsizei vertexStride(char layout)
 {
-    if (mesh_data.layout == MeshLayout::NONE) return 0;
-    assert(mesh_data.layout & MeshLayout::POS);
+    if (layout == MeshLayout::NONE) return 0;
+    assert(layout & MeshLayout::POS);
     GLsizei size = sizeof(GLfloat) * 3;
-    if (mesh_data.layout & MeshLayout::TEX)  size += sizeof(GLfloat) * 2;
-    if (mesh_data.layout & MeshLayout::NORM) size += sizeof(GLfloat) * 3;
+    if (layout & MeshLayout::TEX)  size += sizeof(GLfloat) * 2;
+    if (layout & MeshLayout::NORM) size += sizeof(GLfloat) * 3;
     return size;
 }
 
+GLsizei vertexStride(const MeshData &mesh_data)
+{
+    return vertexStride(mesh_data.layout);
+}
+
 int indexStride(const MeshData &mesh_data)
 {
     int stride = 1;
@@ -340,34 +414,40 @@ Result<MeshData> loadOBJ(
     return successfulResult(std::move(mesh));
 }
 
-Mesh::Mesh(const MeshData &mesh_data)
+// Points the attributes of the bound VAO at the bound GL_ARRAY_BUFFER.
+void setVertexAttributes(char layout)
 {
-    layout = mesh_data.layout;
-    num_vertices = static_cast<int>(mesh_data.indices.size());
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        sizeof(GLfloat) * mesh_data.vertices.size(),
-        &mesh_data.vertices[0],
-        GL_STATIC_DRAW);
-    GLuint stride = vertexStride(mesh_data);
+    GLuint stride = vertexStride(layout);
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (char*)0);
     int top_attr_index = 1;
-    if (mesh_data.layout & MeshLayout::TEX)
+    if (layout & MeshLayout::TEX)
     {
         glEnableVertexAttribArray(top_attr_index);
         glVertexAttribPointer(top_attr_index, 2, GL_FLOAT, GL_FALSE, stride, (GLvoid*)(3*sizeof(GLfloat)));
         top_attr_index++;
     }
-    if (mesh_data.layout & MeshLayout::NORM)
+    if (layout & MeshLayout::NORM)
     {
         glEnableVertexAttribArray(top_attr_index);
         glVertexAttribPointer(top_attr_index, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*)(5*sizeof(GLfloat)));
     }
+}
+
+Mesh::Mesh(const MeshData &mesh_data)
+{
+    layout = mesh_data.layout;
+    num_vertices = static_cast<int>(mesh_data.indices.size());
+    glGenVertexArrays(1, &vao);
+    bindVertexArray(vao);
+    glGenBuffers(1, &vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glBufferData(
+        GL_ARRAY_BUFFER,
+        sizeof(GLfloat) * mesh_data.vertices.size(),
+        &mesh_data.vertices[0],
+        GL_STATIC_DRAW);
+    setVertexAttributes(mesh_data.layout);
     glGenBuffers(1, &ibo);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
     glBufferData(
@@ -375,7 +455,7 @@ Mesh::Mesh(const MeshData &mesh_data)
         sizeof(GLuint) * mesh_data.indices.size(),
         &mesh_data.indices[0],
         GL_STATIC_DRAW);
-    glBindVertexArray(0);
+    bindVertexArray(0);
 }
 
 Mesh::~Mesh()
@@ -383,6 +463,7 @@ Mesh::~Mesh()
     if (!isContextActive()) return;
     std::cout << "What!\n";
     if (vao == 0 || vbo == 0 || ibo == 0) return;
+    forgetVertexArray(vao);
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &vbo);
     glDeleteBuffers(1, &ibo);
@@ -390,14 +471,18 @@ Mesh::~Mesh()
 
 void draw(const Mesh &mesh)
 {
-    glBindVertexArray(mesh.vao);
+    bindVertexArray(mesh.vao);
     glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(mesh.num_vertices), GL_UNSIGNED_INT, 0);
 }
 
 void bind(const Texture &texture)
 {
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture.id);
+    bindTexture(GL_TEXTURE0, GL_TEXTURE_2D, texture.id);
+}
+
+void bind(const TextureArray &texture_array)
+{
+    bindTexture(GL_TEXTURE0, GL_TEXTURE_2D_ARRAY, texture_array.id);
 }
 
 void draw(const Mesh &mesh, const Texture &texture)
@@ -406,242 +491,3937 @@ void draw(const Mesh &mesh, const Texture &texture)
     draw(mesh);
 }
 
-void quickPrintOpenGLError(int lineNum)
+GLenum primitiveMode(MeshPrimitiveType primitive_type)
 {
-    GLenum error;
-    while ((error = glGetError()) != GL_NO_ERROR)
-        std::cerr << "(Line: " << lineNum << ") OpenGL error: " << gluErrorString(error) << "\n";
+    return primitive_type == MeshPrimitiveType::TRIANGLES ? GL_TRIANGLES : GL_LINES;
 }
 
-Result<Shader> makeShader(std::string vertex_src, std::string fragment_src)
+constexpr GLsizei ARENA_INITIAL_VERTICES = 1 << 16;
+constexpr GLsizei ARENA_INITIAL_INDICES  = 1 << 18;
+
+// Replaces the buffer bound to target by one of new_size bytes,
+// keeping the first used_size bytes.
+GLuint regrowBuffer(GLenum target, GLuint buffer, GLsizeiptr used_size, GLsizeiptr new_size)
 {
-    auto compileShaderPart = [](std::string src, GLenum type)
+    GLuint new_buffer;
+    glGenBuffers(1, &new_buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, new_size, nullptr, GL_STATIC_DRAW);
+    if (buffer && used_size > 0)
     {
-        GLuint shaderPart = glCreateShader(type);
-        const char *src_cstr = src.c_str();
-        int length = static_cast<int>(src.size());
-        glShaderSource(shaderPart, 1, &src_cstr, &length);
-        assert(shaderPart > 0);
-        glCompileShader(shaderPart);
-        GLint status;
-        glGetShaderiv(shaderPart, GL_COMPILE_STATUS, &status);
-        if (status == GL_FALSE)
-        {
-            GLint logLength;
-            glGetShaderiv(shaderPart, GL_INFO_LOG_LENGTH, &logLength);
-            std::vector<char> log(logLength);
-            glGetShaderInfoLog(shaderPart, logLength, &logLength, &log[0]);
-            return errorResult<GLuint>(std::string(log.begin(), log.end()));
-        }
-        return successfulResult(shaderPart);
-    };
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used_size);
+    }
+    if (buffer) glDeleteBuffers(1, &buffer);
+    glBindBuffer(target, new_buffer);
+    return new_buffer;
+}
 
-    Shader shader;
-    Result<Shader> result;
-    result.obj = Shader();
+void reserve(ArenaPool &pool, GLsizei vertex_capacity, GLsizei index_capacity)
+{
+    if (!pool.vao) glGenVertexArrays(1, &pool.vao);
+    bindVertexArray(pool.vao);
+    if (vertex_capacity > pool.vertex_capacity)
     {
-        auto vert_result = compileShaderPart(vertex_src, GL_VERTEX_SHADER);
-        auto frag_result = compileShaderPart(fragment_src, GL_FRAGMENT_SHADER);
-        shader.vertex = vert_result.obj;
-        shader.fragment = frag_result.obj;
-        result.success = vert_result.success && frag_result.success;
-        result.error =
-            vert_result.error + (frag_result.success ? "" : "\n")
-            + frag_result.error;
-        if (!result.success) return result;
+        GLsizei stride = vertexStride(pool.layout);
+        pool.vbo = regrowBuffer(
+            GL_ARRAY_BUFFER, pool.vbo,
+            pool.vertex_top * stride, vertex_capacity * stride);
+        setVertexAttributes(pool.layout);
+        pool.vertex_capacity = vertex_capacity;
     }
-    shader.id = glCreateProgram();
-    glAttachShader(shader.id, shader.vertex);
-    glAttachShader(shader.id, shader.fragment);
-    glLinkProgram(shader.id);
-    GLint status;
-    glGetProgramiv(shader.id, GL_LINK_STATUS, &status);
-    if (status == GL_FALSE)
+    if (index_capacity > pool.index_capacity)
     {
-        GLint logLength = 0;
-        glGetProgramiv(shader.id, GL_INFO_LOG_LENGTH, &logLength);
-        std::vector<char> log(logLength);
-        glGetProgramInfoLog(shader.id, logLength, &logLength, &log[0]);
-        result.error  +=
-            (result.success ? "" : "\n")
-            + std::string(log.begin(), log.end());
-        result.success = false;
-        return result;
+        pool.ibo = regrowBuffer(
+            GL_ELEMENT_ARRAY_BUFFER, pool.ibo,
+            pool.index_top * sizeof(GLuint), index_capacity * sizeof(GLuint));
+        pool.index_capacity = index_capacity;
     }
+    bindVertexArray(0);
+}
 
-    result.obj = std::move(shader);
-    return result;
+// First fit from the free list, falling back to the top of the pool.
+// Returns -1 when the pool has to grow first.
+GLsizei takeRange(std::vector<ArenaRange> &free_ranges, GLsizei &top, GLsizei capacity, GLsizei count)
+{
+    for (auto it = free_ranges.begin(); it != free_ranges.end(); it++)
+    {
+        if (it->count < count) continue;
+        GLsizei offset = it->offset;
+        it->offset += count;
+        it->count -= count;
+        if (it->count == 0) free_ranges.erase(it);
+        return offset;
+    }
+    if (top + count > capacity) return -1;
+    GLsizei offset = top;
+    top += count;
+    return offset;
 }
 
-void use(const Shader &shader)
+void giveBackRange(std::vector<ArenaRange> &free_ranges, GLsizei &top, ArenaRange range)
 {
-    glUseProgram(shader.id);
+    if (range.count == 0) return;
+    auto it = std::lower_bound(
+        free_ranges.begin(), free_ranges.end(), range,
+        [](const ArenaRange &a, const ArenaRange &b) { return a.offset < b.offset; });
+    it = free_ranges.insert(it, range);
+    // Merge with neighbours so fragmentation doesn't pile up.
+    if (it + 1 != free_ranges.end() && it->offset + it->count == (it + 1)->offset)
+    {
+        it->count += (it + 1)->count;
+        free_ranges.erase(it + 1);
+    }
+    if (it != free_ranges.begin() && (it - 1)->offset + (it - 1)->count == it->offset)
+    {
+        (it - 1)->count += it->count;
+        it = free_ranges.erase(it) - 1;
+    }
+    if (it->offset + it->count == top)
+    {
+        top = it->offset;
+        free_ranges.erase(it);
+    }
 }
 
-void initTransformationMatrices(Shader &shader)
+ArenaMesh add(MeshArena &arena, const MeshData &mesh_data)
 {
-    shader._model = glGetUniformLocation(shader.id, "model");
-    shader._view = glGetUniformLocation(shader.id, "view");
-    shader._projection = glGetUniformLocation(shader.id, "projection");
+    assert(mesh_data.layout != MeshLayout::NONE);
+    GLsizei stride = vertexStride(mesh_data);
+    GLsizei num_vertices = static_cast<GLsizei>(mesh_data.vertices.size() * sizeof(GLfloat) / stride);
+    // Unindexed data (like the normals lines) gets a trivial index list,
+    // so everything in the arena can be drawn the same way.
+    std::vector<GLuint> sequential_indices;
+    const std::vector<GLuint> *indices = &mesh_data.indices;
+    if (indices->empty())
+    {
+        sequential_indices.resize(num_vertices);
+        for (GLsizei i = 0; i < num_vertices; i++) sequential_indices[i] = i;
+        indices = &sequential_indices;
+    }
+    GLsizei num_indices = static_cast<GLsizei>(indices->size());
+
+    ArenaPool &pool = arena.pools[mesh_data.layout];
+    pool.layout = mesh_data.layout;
+    GLsizei base_vertex = takeRange(pool.free_vertices, pool.vertex_top, pool.vertex_capacity, num_vertices);
+    if (base_vertex < 0)
+    {
+        reserve(pool,
+            std::max({ARENA_INITIAL_VERTICES, pool.vertex_capacity * 2, pool.vertex_top + num_vertices}),
+            pool.index_capacity);
+        base_vertex = takeRange(pool.free_vertices, pool.vertex_top, pool.vertex_capacity, num_vertices);
+    }
+    GLsizei first_index = takeRange(pool.free_indices, pool.index_top, pool.index_capacity, num_indices);
+    if (first_index < 0)
+    {
+        reserve(pool,
+            pool.vertex_capacity,
+            std::max({ARENA_INITIAL_INDICES, pool.index_capacity * 2, pool.index_top + num_indices}));
+        first_index = takeRange(pool.free_indices, pool.index_top, pool.index_capacity, num_indices);
+    }
+    assert(base_vertex >= 0 && first_index >= 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, pool.vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, base_vertex * stride, num_vertices * stride, mesh_data.vertices.data());
+    // The element buffer is VAO state, so go through the copy target
+    // instead of disturbing whatever VAO is bound.
+    glBindBuffer(GL_COPY_WRITE_BUFFER, pool.ibo);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, first_index * sizeof(GLuint), num_indices * sizeof(GLuint), indices->data());
+
+    ArenaAllocation allocation;
+    allocation.layout = mesh_data.layout;
+    allocation.primitive_type = mesh_data.primitive_type;
+    allocation.base_vertex = base_vertex;
+    allocation.num_vertices = num_vertices;
+    allocation.first_index = first_index;
+    allocation.num_indices = num_indices;
+    allocation.live = true;
+
+    ArenaMesh handle;
+    if (!arena.free_ids.empty())
+    {
+        handle.id = arena.free_ids.back();
+        arena.free_ids.pop_back();
+        arena.allocations[handle.id] = allocation;
+    }
+    else
+    {
+        handle.id = static_cast<int>(arena.allocations.size());
+        arena.allocations.push_back(allocation);
+    }
+    return handle;
 }
 
-void setModelTransform(const Shader &shader, glm::mat4 &mat)
+void remove(MeshArena &arena, ArenaMesh mesh)
 {
-    use(shader);
-    glUniformMatrix4fv(shader._model, 1, GL_FALSE, glm::value_ptr(mat));
+    ArenaAllocation &allocation = arena.allocations[mesh.id];
+    assert(allocation.live);
+    ArenaPool &pool = arena.pools[allocation.layout];
+    giveBackRange(pool.free_vertices, pool.vertex_top, {allocation.base_vertex, allocation.num_vertices});
+    giveBackRange(pool.free_indices, pool.index_top, {allocation.first_index, allocation.num_indices});
+    allocation.live = false;
+    arena.free_ids.push_back(mesh.id);
 }
 
-void setCameraTransform(const Shader &shader, glm::mat4 &mat)
+// Packs the live meshes of every pool tightly into fresh buffers.
+// Indices are relative to base_vertex, so they can be copied as they are.
+void compact(MeshArena &arena)
 {
-    use(shader);
-    glUniformMatrix4fv(shader._view, 1, GL_FALSE, glm::value_ptr(mat));
+    for (auto &layout_and_pool : arena.pools)
+    {
+        ArenaPool &pool = layout_and_pool.second;
+        if (pool.free_vertices.empty() && pool.free_indices.empty()) continue;
+        GLsizei stride = vertexStride(pool.layout);
+        GLsizei live_vertices = pool.vertex_top, live_indices = pool.index_top;
+        for (auto &range : pool.free_vertices) live_vertices -= range.count;
+        for (auto &range : pool.free_indices)  live_indices -= range.count;
+
+        GLuint new_buffers[2];
+        glGenBuffers(2, new_buffers);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffers[0]);
+        glBufferData(GL_COPY_WRITE_BUFFER, pool.vertex_capacity * stride, nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_READ_BUFFER, pool.vbo);
+        GLsizei vertex_top = 0;
+        for (auto &allocation : arena.allocations)
+        {
+            if (!allocation.live || allocation.layout != pool.layout) continue;
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                allocation.base_vertex * stride, vertex_top * stride,
+                allocation.num_vertices * stride);
+            allocation.base_vertex = vertex_top;
+            vertex_top += allocation.num_vertices;
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffers[1]);
+        glBufferData(GL_COPY_WRITE_BUFFER, pool.index_capacity * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_READ_BUFFER, pool.ibo);
+        GLsizei index_top = 0;
+        for (auto &allocation : arena.allocations)
+        {
+            if (!allocation.live || allocation.layout != pool.layout) continue;
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                allocation.first_index * sizeof(GLuint), index_top * sizeof(GLuint),
+                allocation.num_indices * sizeof(GLuint));
+            allocation.first_index = index_top;
+            index_top += allocation.num_indices;
+        }
+        assert(vertex_top == live_vertices && index_top == live_indices);
+
+        glDeleteBuffers(1, &pool.vbo);
+        glDeleteBuffers(1, &pool.ibo);
+        pool.vbo = new_buffers[0];
+        pool.ibo = new_buffers[1];
+        pool.vertex_top = vertex_top;
+        pool.index_top = index_top;
+        pool.free_vertices.clear();
+        pool.free_indices.clear();
+        bindVertexArray(pool.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, pool.vbo);
+        setVertexAttributes(pool.layout);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.ibo);
+        bindVertexArray(0);
+    }
 }
 
-void setProjectionTransform(const Shader &shader, glm::mat4 mat)
+void bind(MeshArena &arena, char layout)
 {
-    use(shader);
-    glUniformMatrix4fv(shader._projection, 1, GL_FALSE, glm::value_ptr(mat));
+    bindVertexArray(arena.pools[layout].vao);
 }
 
-void setColorUniform(const Shader &shader, const char *name, glm::vec3 color)
+// Meshes of the same layout share a VAO, so drawing them back to back
+// only binds it once.
+void draw(MeshArena &arena, ArenaMesh mesh)
 {
-    GLint loc = glGetUniformLocation(shader.id, name);
-    use(shader);
-    glUniform3fv(loc, 1, glm::value_ptr(color));
+    const ArenaAllocation &allocation = arena.allocations[mesh.id];
+    assert(allocation.live);
+    bind(arena, allocation.layout);
+    glDrawElementsBaseVertex(
+        primitiveMode(allocation.primitive_type),
+        allocation.num_indices,
+        GL_UNSIGNED_INT,
+        (GLvoid*)(allocation.first_index * sizeof(GLuint)),
+        allocation.base_vertex);
 }
 
-void setHasTexture(Shader &shader)
+void draw(MeshArena &arena, ArenaMesh mesh, const Texture &texture)
 {
-    GLint texture_loc = glGetUniformLocation(shader.id, "tex");
-    use(shader);
-    glUniform1i(texture_loc, 0);
+    bind(texture);
+    draw(arena, mesh);
 }
 
-Shader::~Shader()
+void draw(MeshArena &arena, ArenaMesh mesh, const Material &material)
 {
-    if (!isContextActive()) return;
-    if (!id) return;
-    glDetachShader(id, vertex);
-    glDetachShader(id, fragment);
-    glDeleteShader(vertex);
-    glDeleteShader(fragment);
-    glDeleteProgram(id);
+    if (material.texture) bind(*material.texture);
+    draw(arena, mesh);
 }
 
-Image::Image(const char *filename)
+MeshArena::~MeshArena()
 {
-    std::string full_path = IMAGE_DIR;
-    full_path += filename;
-    data = stbi_load(full_path.data(), &width, &height, &channels, 4);
+    if (!isContextActive()) return;
+    for (auto &layout_and_pool : pools)
+    {
+        ArenaPool &pool = layout_and_pool.second;
+        forgetVertexArray(pool.vao);
+        glDeleteVertexArrays(1, &pool.vao);
+        glDeleteBuffers(1, &pool.vbo);
+        glDeleteBuffers(1, &pool.ibo);
+    }
 }
 
-Texture::Texture(const Image &image)
+bool isBatchingSupported()
 {
-    glGenTextures(1, &id);
-    glBindTexture(GL_TEXTURE_2D, id);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    GLenum format = image.channels == 4 ? GL_RGBA : GL_RGB;
-    glTexImage2D(GL_TEXTURE_2D, 0, format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.data);
+    return GLEW_VERSION_4_3
+        || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_base_instance);
 }
 
-Texture::~Texture()
+void submit(DrawBatcher &batcher, ArenaMesh mesh, const glm::mat4 &model)
 {
-    if (!isContextActive()) return;
-    if (!id) return;
-    glDeleteTextures(1, &id);
+    batcher.requests.push_back({mesh, model});
 }
 
-PathMesh::PathMesh(MeshData &mesh_data)
+void reserve(DrawBatcher &batcher, GLsizei capacity)
 {
-    assert(mesh_data.primitive_type == MeshPrimitiveType::LINE_SEGMENTS);
-    data = std::move(mesh_data);
-    face_pairs.reserve(mesh_data.indices.size()/2);
-    // Assumption: faces are triangles.
-    // In the future this could be a parameter.
-    int face_sides = 3;
-    int indices_per_face = 2*face_sides;
-    for (int i = 0; i < mesh_data.indices.size(); i += indices_per_face)
+    if (capacity <= batcher.capacity) return;
+    capacity = std::max(capacity, batcher.capacity * 2);
+    if (!batcher.command_buffer)
     {
-        int face_index = i/indices_per_face;
-        int line_beginning_index = i/face_sides;
-        for (int line = line_beginning_index; i < face_sides; i++)
-        {
-            if (face_pairs[line].first == 0)
-                face_pairs[line].first = face_index;
-            else if (face_pairs[line].second == 0)
-                face_pairs[line].second = face_index;
-            else assert(false); // three faces sharing a line? not possible.
-        };
+        glGenBuffers(1, &batcher.command_buffer);
+        glGenBuffers(1, &batcher.model_buffer);
+        glGenBuffers(1, &batcher.draw_id_buffer);
     }
+    // The draw id of command i is i, fed to the shader through an
+    // instanced attribute offset by base_instance.
+    std::vector<GLuint> draw_ids(capacity);
+    for (GLsizei i = 0; i < capacity; i++) draw_ids[i] = i;
+    glBindBuffer(GL_ARRAY_BUFFER, batcher.draw_id_buffer);
+    glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(GLuint), draw_ids.data(), GL_STATIC_DRAW);
+    batcher.capacity = capacity;
+    // Attribute pointers captured the old buffer; redo them lazily.
+    batcher.prepared_vaos.clear();
 }
 
-void offset(PathMesh &path_mesh, glm::vec3 amount)
+void prepareVAO(DrawBatcher &batcher, GLuint vao)
 {
-    auto &data = path_mesh.data.vertices;
-    auto stride = vertexStride(path_mesh.data);
-    for (int i = 0; i < data.size(); i += stride)
-    {
-        data[i+0] += amount.x;
-        data[i+1] += amount.y;
-        data[i+2] += amount.z;
-    }
+    if (std::find(batcher.prepared_vaos.begin(), batcher.prepared_vaos.end(), vao) != batcher.prepared_vaos.end()) return;
+    bindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, batcher.draw_id_buffer);
+    glEnableVertexAttribArray(BATCH_DRAW_ID_ATTRIBUTE);
+    glVertexAttribIPointer(BATCH_DRAW_ID_ATTRIBUTE, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+    glVertexAttribDivisor(BATCH_DRAW_ID_ATTRIBUTE, 1);
+    batcher.prepared_vaos.push_back(vao);
 }
 
-int main(int argc, char *argv[])
+// Draws everything submitted since the last flush, with whatever shader
+// and textures are bound. Draws are grouped by layout and primitive type
+// so each group costs one VAO bind and one driver call.
+void flush(DrawBatcher &batcher, MeshArena &arena)
 {
-    auto parseObjResult = loadOBJ(loadFile("res/models/just_pyramid_ball.obj"));
-    if (!parseObjResult.success)
+    assert(isBatchingSupported());
+    batcher.batches_last_flush = 0;
+    if (batcher.requests.empty()) return;
+
+    auto groupKey = [&](const BatchRequest &request)
     {
-        std::cerr << parseObjResult.error << "\n";
-        return EXIT_FAILURE;
+        const ArenaAllocation &allocation = arena.allocations[request.mesh.id];
+        return std::make_pair(allocation.layout, allocation.primitive_type);
+    };
+    std::stable_sort(batcher.requests.begin(), batcher.requests.end(),
+        [&](const BatchRequest &a, const BatchRequest &b) { return groupKey(a) < groupKey(b); });
+
+    GLsizei num_requests = static_cast<GLsizei>(batcher.requests.size());
+    reserve(batcher, num_requests);
+    batcher.commands.clear();
+    batcher.models.clear();
+    for (GLsizei i = 0; i < num_requests; i++)
+    {
+        const BatchRequest &request = batcher.requests[i];
+        const ArenaAllocation &allocation = arena.allocations[request.mesh.id];
+        assert(allocation.live);
+        DrawElementsIndirectCommand command;
+        command.count = allocation.num_indices;
+        command.instance_count = 1;
+        command.first_index = allocation.first_index;
+        command.base_vertex = allocation.base_vertex;
+        command.base_instance = i;
+        batcher.commands.push_back(command);
+        batcher.models.push_back(request.model);
     }
-    MeshData model_mesh_data = parseObjResult.obj;
 
-    parseObjResult = loadOBJ(loadFile("res/models/path.obj"), MeshPrimitiveType::LINE_SEGMENTS);
-    if (!parseObjResult.success)
+    // Orphan and refill, so the driver never waits on last frame's draws.
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batcher.command_buffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, batcher.capacity * sizeof(DrawElementsIndirectCommand), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, num_requests * sizeof(DrawElementsIndirectCommand), batcher.commands.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, batcher.model_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, batcher.capacity * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, num_requests * sizeof(glm::mat4), batcher.models.data());
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BATCH_MODELS_BINDING, batcher.model_buffer);
+
+    GLsizei group_begin = 0;
+    while (group_begin < num_requests)
     {
-        std::cerr << parseObjResult.error << "\n";
-        return EXIT_FAILURE;
+        auto key = groupKey(batcher.requests[group_begin]);
+        GLsizei group_end = group_begin + 1;
+        while (group_end < num_requests && groupKey(batcher.requests[group_end]) == key)
+            group_end++;
+        GLuint vao = arena.pools[key.first].vao;
+        prepareVAO(batcher, vao);
+        bindVertexArray(vao);
+        glMultiDrawElementsIndirect(
+            primitiveMode(key.second),
+            GL_UNSIGNED_INT,
+            (GLvoid*)(group_begin * sizeof(DrawElementsIndirectCommand)),
+            group_end - group_begin,
+            0);
+        batcher.batches_last_flush++;
+        group_begin = group_end;
     }
-    PathMesh path_mesh {parseObjResult.obj};
-    MeshData normals_mesh_data = normalsMeshData(path_mesh.data);
+    bindVertexArray(0);
+    batcher.requests.clear();
+}
 
-    Image model_texture_image {"chinese_box.gif"};
-    Image floor_texture_image {"slimy_vines.png"};
+DrawBatcher::~DrawBatcher()
+{
+    if (!isContextActive()) return;
+    if (!command_buffer) return;
+    glDeleteBuffers(1, &command_buffer);
+    glDeleteBuffers(1, &model_buffer);
+    glDeleteBuffers(1, &draw_id_buffer);
+}
 
-    int screen_width = 1600; 
-    int screen_height = 900;
+constexpr GLsizeiptr INSTANCE_STREAM_INITIAL_SIZE = 1 << 20;
 
-    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_AUDIO);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
-    SDL_DisplayMode display_mode;
-    SDL_GetCurrentDisplayMode(0, &display_mode);
-    // screen_width = display_mode.w;
-    // screen_height = display_mode.h;
-    SDL_Window *window = SDL_CreateWindow(
-        "Lego Island", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-        screen_width, screen_height, SDL_WINDOW_OPENGL);
-    if (!window)
+// Copies size bytes into the stream and returns their offset in its buffer.
+GLsizeiptr write(InstanceStream &stream, const void *data, GLsizeiptr size)
+{
+    if (!stream.buffer) glGenBuffers(1, &stream.buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+    if (size > stream.capacity || stream.offset + size > stream.capacity)
     {
-        std::cerr << "SDL error: " << SDL_GetError() << "\n";
-        return EXIT_FAILURE;
+        stream.capacity = std::max({stream.capacity, size, INSTANCE_STREAM_INITIAL_SIZE});
+        glBufferData(GL_ARRAY_BUFFER, stream.capacity, nullptr, GL_STREAM_DRAW);
+        stream.offset = 0;
     }
-    SDL_GLContext context = SDL_GL_CreateContext(window);
-    if (!context)
+    void *mapped = glMapBufferRange(
+        GL_ARRAY_BUFFER, stream.offset, size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    if (mapped)
     {
-        std::cerr << "SDL error: " << SDL_GetError() << "\n";
-        return EXIT_FAILURE;
+        std::memcpy(mapped, data, size);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
     }
-    context_active = true;
-    SDL_ShowCursor(0);
+    // The range is never in use by a draw, so this can't stall either.
+    else glBufferSubData(GL_ARRAY_BUFFER, stream.offset, size, data);
+    GLsizeiptr offset = stream.offset;
+    stream.offset += size;
+    return offset;
+}
 
-    glewExperimental = GL_TRUE;
-    GLenum initStatus = glewInit();
+Result<StreamRing> makeStreamRing(GLsizeiptr frame_size)
+{
+    if (!GLEW_VERSION_4_4 && !GLEW_ARB_buffer_storage)
+        return errorResult<StreamRing>("Persistent mapping needs ARB_buffer_storage");
+    StreamRing ring;
+    GLint uniform_alignment = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_alignment);
+    ring.alignment = std::max<GLsizeiptr>(ring.alignment, uniform_alignment);
+    if (GLEW_VERSION_4_3 || GLEW_ARB_shader_storage_buffer_object)
+    {
+        GLint storage_alignment = 0;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storage_alignment);
+        ring.alignment = std::max<GLsizeiptr>(ring.alignment, storage_alignment);
+    }
+    ring.frame_size = (frame_size + ring.alignment - 1) / ring.alignment * ring.alignment;
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    GLsizeiptr size = ring.frame_size * STREAM_RING_FRAMES;
+    glGenBuffers(1, &ring.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, flags);
+    ring.mapped = static_cast<char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags));
+    if (!ring.mapped)
+        return errorResult<StreamRing>("Could not map the stream ring");
+    return successfulResult(std::move(ring));
+}
+
+// Waits until the GPU is done with this frame's section, then starts
+// writing at its beginning. Only blocks when the CPU is a full
+// STREAM_RING_FRAMES ahead.
+void beginFrame(StreamRing &ring)
+{
+    GLsync &fence = ring.fences[ring.frame];
+    if (fence)
+    {
+        GLenum status;
+        do status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        while (status == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+    ring.offset = ring.frame * ring.frame_size;
+}
+
+void endFrame(StreamRing &ring)
+{
+    ring.fences[ring.frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring.frame = (ring.frame + 1) % STREAM_RING_FRAMES;
+}
+
+// Copies size bytes into this frame's section and returns their offset
+// in the ring's buffer, aligned for uniform and storage buffer binding.
+// Returns -1 when the rest of the section can't hold them.
+GLsizeiptr write(StreamRing &ring, const void *data, GLsizeiptr size)
+{
+    GLsizeiptr frame_end = (ring.frame + 1) * ring.frame_size;
+    if (size > frame_end - ring.offset) return -1;
+    GLsizeiptr offset = ring.offset;
+    std::memcpy(ring.mapped + offset, data, size);
+    ring.offset = std::min(frame_end, (offset + size + ring.alignment - 1) / ring.alignment * ring.alignment);
+    return offset;
+}
+
+// Draws line segments straight out of the ring, for debug geometry that
+// changes every frame. Only positions are used. False when the lines
+// don't fit in what's left of the frame's section, and nothing was drawn.
+bool drawLines(StreamRing &ring, const MeshData &lines)
+{
+    assert(lines.primitive_type == MeshPrimitiveType::LINE_SEGMENTS);
+    GLsizei stride = vertexStride(lines);
+    GLsizei num_vertices = static_cast<GLsizei>(lines.vertices.size() * sizeof(GLfloat) / stride);
+    if (num_vertices == 0) return true;
+    GLsizeiptr offset = write(ring, lines.vertices.data(), lines.vertices.size() * sizeof(GLfloat));
+    GLsizeiptr index_offset = 0;
+    if (offset >= 0 && !lines.indices.empty())
+        index_offset = write(ring, lines.indices.data(), lines.indices.size() * sizeof(GLuint));
+    if (offset < 0 || index_offset < 0) return false;
+    if (!ring.lines_vao) glGenVertexArrays(1, &ring.lines_vao);
+    bindVertexArray(ring.lines_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, ring.buffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (GLvoid*)offset);
+    if (lines.indices.empty())
+    {
+        glDrawArrays(GL_LINES, 0, num_vertices);
+    }
+    else
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ring.buffer);
+        glDrawElements(GL_LINES, static_cast<GLsizei>(lines.indices.size()), GL_UNSIGNED_INT, (GLvoid*)index_offset);
+    }
+    bindVertexArray(0);
+    return true;
+}
+
+StreamRing::~StreamRing()
+{
+    if (!isContextActive()) return;
+    for (GLsync fence : fences)
+        if (fence) glDeleteSync(fence);
+    if (lines_vao)
+    {
+        forgetVertexArray(lines_vao);
+        glDeleteVertexArrays(1, &lines_vao);
+    }
+    if (!buffer) return;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+    glDeleteBuffers(1, &buffer);
+}
+
+// Points the instance_model attribute of the bound VAO at offset in buffer.
+void setInstanceAttributes(GLuint buffer, GLsizeiptr offset)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    for (GLuint column = 0; column < 4; column++)
+    {
+        GLuint attribute = INSTANCE_MODEL_ATTRIBUTE + column;
+        glEnableVertexAttribArray(attribute);
+        glVertexAttribPointer(
+            attribute, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+            (GLvoid*)(offset + column * sizeof(glm::vec4)));
+        glVertexAttribDivisor(attribute, 1);
+    }
+}
+
+// Arena VAOs are shared by every mesh of a layout, so instanced draws
+// turn the attribute back off for the plain draws that follow.
+void clearInstanceAttributes()
+{
+    for (GLuint column = 0; column < 4; column++)
+    {
+        glVertexAttribDivisor(INSTANCE_MODEL_ATTRIBUTE + column, 0);
+        glDisableVertexAttribArray(INSTANCE_MODEL_ATTRIBUTE + column);
+    }
+}
+
+// Draws one copy of mesh per model matrix in a single call.
+// Stream is an InstanceStream or a StreamRing.
+template <typename Stream>
+void drawInstanced(
+    Stream &stream, MeshArena &arena, ArenaMesh mesh, const Texture &texture,
+    const glm::mat4 *models, GLsizei count)
+{
+    if (count == 0) return;
+    const ArenaAllocation &allocation = arena.allocations[mesh.id];
+    assert(allocation.live);
+    GLsizeiptr offset = write(stream, models, count * sizeof(glm::mat4));
+    bind(texture);
+    bind(arena, allocation.layout);
+    setInstanceAttributes(stream.buffer, offset);
+    glDrawElementsInstancedBaseVertex(
+        primitiveMode(allocation.primitive_type),
+        allocation.num_indices,
+        GL_UNSIGNED_INT,
+        (GLvoid*)(allocation.first_index * sizeof(GLuint)),
+        count,
+        allocation.base_vertex);
+    clearInstanceAttributes();
+}
+
+// Like drawInstanced, with each instance also picking its layer of the array.
+template <typename Stream>
+void drawInstanced(
+    Stream &stream, MeshArena &arena, ArenaMesh mesh, const TextureArray &texture_array,
+    const glm::mat4 *models, const GLfloat *layers, GLsizei count)
+{
+    if (count == 0) return;
+    const ArenaAllocation &allocation = arena.allocations[mesh.id];
+    assert(allocation.live);
+    GLsizeiptr model_offset = write(stream, models, count * sizeof(glm::mat4));
+    GLsizeiptr layer_offset = write(stream, layers, count * sizeof(GLfloat));
+    bind(texture_array);
+    bind(arena, allocation.layout);
+    setInstanceAttributes(stream.buffer, model_offset);
+    glEnableVertexAttribArray(INSTANCE_LAYER_ATTRIBUTE);
+    glVertexAttribPointer(INSTANCE_LAYER_ATTRIBUTE, 1, GL_FLOAT, GL_FALSE, sizeof(GLfloat), (GLvoid*)layer_offset);
+    glVertexAttribDivisor(INSTANCE_LAYER_ATTRIBUTE, 1);
+    glDrawElementsInstancedBaseVertex(
+        primitiveMode(allocation.primitive_type),
+        allocation.num_indices,
+        GL_UNSIGNED_INT,
+        (GLvoid*)(allocation.first_index * sizeof(GLuint)),
+        count,
+        allocation.base_vertex);
+    glVertexAttribDivisor(INSTANCE_LAYER_ATTRIBUTE, 0);
+    glDisableVertexAttribArray(INSTANCE_LAYER_ATTRIBUTE);
+    clearInstanceAttributes();
+}
+
+InstanceStream::~InstanceStream()
+{
+    if (!isContextActive()) return;
+    if (!buffer) return;
+    glDeleteBuffers(1, &buffer);
+}
+
+void quickPrintOpenGLError(int lineNum)
+{
+    GLenum error;
+    while ((error = glGetError()) != GL_NO_ERROR)
+        std::cerr << "(Line: " << lineNum << ") OpenGL error: " << gluErrorString(error) << "\n";
+}
+
+// Asks the driver for every active uniform once, so setting them later
+// never goes through glGetUniformLocation.
+void reflectUniforms(Shader &shader)
+{
+    shader.uniforms.clear();
+    GLint num_uniforms = 0, max_name_length = 0;
+    glGetProgramiv(shader.id, GL_ACTIVE_UNIFORMS, &num_uniforms);
+    glGetProgramiv(shader.id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_name_length);
+    std::vector<char> name_buffer(std::max(max_name_length, 1));
+    for (GLint i = 0; i < num_uniforms; i++)
+    {
+        GLsizei name_length = 0;
+        UniformInfo info;
+        glGetActiveUniform(
+            shader.id, i, static_cast<GLsizei>(name_buffer.size()),
+            &name_length, &info.size, &info.type, &name_buffer[0]);
+        std::string name(name_buffer.begin(), name_buffer.begin() + name_length);
+        info.location = glGetUniformLocation(shader.id, name.c_str());
+        if (info.location < 0) continue; // lives in a uniform block
+        // Arrays are reported as "name[0]"; look them up by plain name.
+        if (name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0)
+            name.resize(name.size() - 3);
+        std::uint32_t hash = hashName(name.c_str());
+        assert(!contains(shader.uniforms, hash) && "Uniform name hash collision");
+        shader.uniforms[hash] = info;
+    }
+}
+
+// Setup shared by freshly linked programs and ones loaded from the cache.
+Result<Shader> finishShader(Shader shader)
+{
+    reflectUniforms(shader);
+    shader.frame_constants_block = glGetUniformBlockIndex(shader.id, FRAME_CONSTANTS_BLOCK);
+    if (shader.frame_constants_block != GL_INVALID_INDEX)
+    {
+        GLint block_size = 0;
+        glGetActiveUniformBlockiv(shader.id, shader.frame_constants_block, GL_UNIFORM_BLOCK_DATA_SIZE, &block_size);
+        if (block_size != sizeof(FrameConstants))
+            return errorResult<Shader>("FrameConstants block doesn't match the C++ struct");
+        glUniformBlockBinding(shader.id, shader.frame_constants_block, FRAME_CONSTANTS_BINDING);
+    }
+    return successfulResult(std::move(shader));
+}
+
+// FNV-1a, 64 bit.
+std::uint64_t hashBytes(const unsigned char *data, size_t size, std::uint64_t hash = 14695981039346656037ull)
+{
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    return hash;
+}
+
+std::uint64_t hashBytes(const std::string &data, std::uint64_t hash = 14695981039346656037ull)
+{
+    return hashBytes(reinterpret_cast<const unsigned char*>(data.data()), data.size(), hash);
+}
+
+// Binaries only load on the exact driver that produced them, so the
+// driver strings are part of the key. Empty when caching isn't possible.
+std::string programCachePath(const std::string &vertex_src, const std::string &fragment_src)
+{
+    if (!GLEW_VERSION_4_1 && !GLEW_ARB_get_program_binary) return "";
+    GLint num_formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    if (num_formats == 0) return "";
+    std::string key = vertex_src + '\0' + fragment_src + '\0';
+    for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION})
+    {
+        auto value = reinterpret_cast<const char*>(glGetString(name));
+        key += value ? value : "";
+        key += '\0';
+    }
+    std::stringstream path;
+    path << SHADER_CACHE_DIR << std::hex << hashBytes(key) << ".bin";
+    return path.str();
+}
+
+constexpr std::uint32_t PROGRAM_BINARY_MAGIC = 0x31425043; // "CPB1"
+
+// Fails quietly: a missing or rejected binary just means compiling from source.
+bool loadProgramBinary(Shader &shader, const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::uint32_t magic = 0;
+    GLenum format = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&format), sizeof(format));
+    if (!file || magic != PROGRAM_BINARY_MAGIC) return false;
+    std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (binary.empty()) return false;
+
+    shader.id = glCreateProgram();
+    glProgramBinary(shader.id, format, binary.data(), static_cast<GLsizei>(binary.size()));
+    GLint status = GL_FALSE;
+    glGetProgramiv(shader.id, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        glDeleteProgram(shader.id);
+        shader.id = 0;
+        return false;
+    }
+    return true;
+}
+
+void saveProgramBinary(const Shader &shader, const std::string &path)
+{
+    GLint length = 0;
+    glGetProgramiv(shader.id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length == 0) return;
+    std::vector<char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(shader.id, length, &length, &format, binary.data());
+
+    std::error_code error;
+    std::filesystem::create_directories(SHADER_CACHE_DIR, error);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return;
+    file.write(reinterpret_cast<const char*>(&PROGRAM_BINARY_MAGIC), sizeof(PROGRAM_BINARY_MAGIC));
+    file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+    file.write(binary.data(), length);
+}
+
+bool isParallelCompileSupported()
+{
+    return GLEW_ARB_parallel_shader_compile;
+}
+
+// Hands both stages and the link to the driver without asking for any
+// status, so with parallel compile the work happens on driver threads.
+// A cached binary skips compilation entirely.
+ShaderBuild startShaderBuild(const std::string &vertex_src, const std::string &fragment_src)
+{
+    ShaderBuild build;
+    build.cache_path = programCachePath(vertex_src, fragment_src);
+    if (!build.cache_path.empty() && loadProgramBinary(build.shader, build.cache_path))
+    {
+        build.from_cache = true;
+        return build;
+    }
+
+    auto submitShaderPart = [](const std::string &src, GLenum type)
+    {
+        GLuint shaderPart = glCreateShader(type);
+        const char *src_cstr = src.c_str();
+        int length = static_cast<int>(src.size());
+        glShaderSource(shaderPart, 1, &src_cstr, &length);
+        assert(shaderPart > 0);
+        glCompileShader(shaderPart);
+        return shaderPart;
+    };
+
+    Shader &shader = build.shader;
+    shader.vertex = submitShaderPart(vertex_src, GL_VERTEX_SHADER);
+    shader.fragment = submitShaderPart(fragment_src, GL_FRAGMENT_SHADER);
+    shader.id = glCreateProgram();
+    if (!build.cache_path.empty())
+        glProgramParameteri(shader.id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(shader.id, shader.vertex);
+    glAttachShader(shader.id, shader.fragment);
+    // Linking failed stages just fails the link; their logs are read
+    // in finishShaderBuild.
+    glLinkProgram(shader.id);
+    return build;
+}
+
+// Never blocks. Without parallel compile the driver did the work inside
+// startShaderBuild, so the build is always done.
+bool isShaderBuildDone(const ShaderBuild &build)
+{
+    if (build.from_cache || !isParallelCompileSupported()) return true;
+    GLint done = GL_TRUE;
+    glGetProgramiv(build.shader.id, GL_COMPLETION_STATUS_ARB, &done);
+    return done == GL_TRUE;
+}
+
+// Blocks until the build is done, then checks it.
+Result<Shader> finishShaderBuild(ShaderBuild &build)
+{
+    if (build.from_cache) return finishShader(std::move(build.shader));
+
+    auto checkShaderPart = [](GLuint shaderPart)
+    {
+        GLint status;
+        glGetShaderiv(shaderPart, GL_COMPILE_STATUS, &status);
+        if (status == GL_FALSE)
+        {
+            GLint logLength;
+            glGetShaderiv(shaderPart, GL_INFO_LOG_LENGTH, &logLength);
+            std::vector<char> log(logLength);
+            glGetShaderInfoLog(shaderPart, logLength, &logLength, &log[0]);
+            return errorResult<GLuint>(std::string(log.begin(), log.end()));
+        }
+        return successfulResult(shaderPart);
+    };
+
+    Shader shader = std::move(build.shader);
+    Result<Shader> result;
+    result.obj = Shader();
+    {
+        auto vert_result = checkShaderPart(shader.vertex);
+        auto frag_result = checkShaderPart(shader.fragment);
+        result.success = vert_result.success && frag_result.success;
+        result.error =
+            vert_result.error + (frag_result.success ? "" : "\n")
+            + frag_result.error;
+        if (!result.success) return result;
+    }
+    GLint status;
+    glGetProgramiv(shader.id, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        GLint logLength = 0;
+        glGetProgramiv(shader.id, GL_INFO_LOG_LENGTH, &logLength);
+        std::vector<char> log(logLength);
+        glGetProgramInfoLog(shader.id, logLength, &logLength, &log[0]);
+        result.error  +=
+            (result.success ? "" : "\n")
+            + std::string(log.begin(), log.end());
+        result.success = false;
+        return result;
+    }
+
+    auto finished = finishShader(std::move(shader));
+    if (finished.success && !build.cache_path.empty())
+        saveProgramBinary(finished.obj, build.cache_path);
+    return finished;
+}
+
+Result<Shader> makeShader(std::string vertex_src, std::string fragment_src)
+{
+    ShaderBuild build = startShaderBuild(vertex_src, fragment_src);
+    return finishShaderBuild(build);
+}
+
+std::string withFeatureDefines(const std::string &src, int features)
+{
+    static const std::pair<ShaderFeature, const char*> feature_names[] =
+    {
+        {TEXTURED, "TEXTURED"},
+        {BATCHED, "BATCHED"},
+        {INSTANCED, "INSTANCED"},
+        {TEXTURE_ARRAY, "TEXTURE_ARRAY"},
+    };
+    std::string defines;
+    for (auto &feature : feature_names)
+        if (features & feature.first)
+            defines += std::string("#define ") + feature.second + " 1\n";
+    if (defines.empty()) return src;
+
+    // #version has to stay first. #line keeps error messages pointing
+    // at the lines of the file on disk.
+    size_t insert_at = 0;
+    int next_line = 1;
+    if (src.compare(0, 8, "#version") == 0)
+    {
+        insert_at = src.find('\n');
+        insert_at = insert_at == std::string::npos ? src.size() : insert_at + 1;
+        next_line = 2;
+    }
+    std::string result = src.substr(0, insert_at);
+    if (insert_at > 0 && result.back() != '\n') result += '\n';
+    result += defines + "#line " + std::to_string(next_line) + "\n" + src.substr(insert_at);
+    return result;
+}
+
+// Starts compiling a variant in the background if it isn't already
+// compiled or on its way.
+void prepareVariant(ShaderVariants &variants, int features)
+{
+    if (contains(variants.compiled, features) || contains(variants.pending, features)) return;
+    variants.pending.emplace(features, startShaderBuild(
+        withFeatureDefines(variants.vertex_src, features),
+        withFeatureDefines(variants.fragment_src, features)));
+}
+
+bool areVariantsReady(const ShaderVariants &variants)
+{
+    for (auto &features_and_build : variants.pending)
+        if (!isShaderBuildDone(features_and_build.second)) return false;
+    return true;
+}
+
+// Compiles the variant on first use, blocking if it has to.
+Result<Shader*> variant(ShaderVariants &variants, int features)
+{
+    auto compiled = variants.compiled.find(features);
+    if (compiled != variants.compiled.end())
+        return successfulResult(&compiled->second);
+    auto failed = variants.failed.find(features);
+    if (failed != variants.failed.end())
+        return errorResult<Shader*>(failed->second);
+    prepareVariant(variants, features);
+    auto pending = variants.pending.find(features);
+    auto shaderResult = finishShaderBuild(pending->second);
+    variants.pending.erase(pending);
+    if (!shaderResult.success)
+    {
+        variants.failed[features] = shaderResult.error;
+        return errorResult<Shader*>(shaderResult.error);
+    }
+    Shader &shader = variants.compiled.emplace(features, std::move(shaderResult.obj)).first->second;
+    if (variants.on_compiled) variants.on_compiled(shader, features);
+    return successfulResult(&shader);
+}
+
+// For draws every frame: a variant that doesn't compile is reported
+// once, and fallback, which the caller has already checked, stands in.
+Shader &variantOr(ShaderVariants &variants, int features, Shader &fallback)
+{
+    bool known_failure = contains(variants.failed, features);
+    auto shaderResult = variant(variants, features);
+    if (shaderResult.success) return *shaderResult.obj;
+    if (!known_failure) std::cerr << "Shader error: " << shaderResult.error << "\n";
+    return fallback;
+}
+
+// Rebuilds every compiled variant from new sources, all or nothing: if
+// any of them fails, the old programs all stay.
+Result<bool> reloadVariants(ShaderVariants &variants, const std::string &vertex_src, const std::string &fragment_src)
+{
+    std::map<int, ShaderBuild> builds;
+    for (auto &features_and_shader : variants.compiled)
+    {
+        int features = features_and_shader.first;
+        builds.emplace(features, startShaderBuild(
+            withFeatureDefines(vertex_src, features),
+            withFeatureDefines(fragment_src, features)));
+    }
+    std::map<int, Shader> rebuilt;
+    for (auto &features_and_build : builds)
+    {
+        auto shaderResult = finishShaderBuild(features_and_build.second);
+        if (!shaderResult.success) return errorResult<bool>(shaderResult.error);
+        rebuilt.emplace(features_and_build.first, std::move(shaderResult.obj));
+    }
+    variants.vertex_src = vertex_src;
+    variants.fragment_src = fragment_src;
+    variants.pending.clear();
+    variants.failed.clear();
+    // Swapped rather than assigned, so the old programs are deleted with
+    // rebuilt, and pointers into compiled stay valid.
+    for (auto &features_and_shader : rebuilt)
+    {
+        Shader &shader = variants.compiled.at(features_and_shader.first);
+        std::swap(shader, features_and_shader.second);
+        if (variants.on_compiled) variants.on_compiled(shader, features_and_shader.first);
+    }
+    return successfulResult(true);
+}
+
+int shaderFeatures(const Material &material)
+{
+    int features = NO_FEATURES;
+    if (material.texture) features |= TEXTURED;
+    return features;
+}
+
+void use(const Shader &shader)
+{
+    useProgram(shader.id);
+}
+
+GLint uniformLocation(const Shader &shader, std::uint32_t hash)
+{
+    auto uniform = shader.uniforms.find(hash);
+    return uniform == shader.uniforms.end() ? -1 : uniform->second.location;
+}
+
+bool uniformTypeMatches(GLenum type, const GLint &)     { return type == GL_INT || type == GL_BOOL; }
+bool uniformTypeMatches(GLenum type, const GLfloat &)   { return type == GL_FLOAT; }
+bool uniformTypeMatches(GLenum type, const glm::vec2 &) { return type == GL_FLOAT_VEC2; }
+bool uniformTypeMatches(GLenum type, const glm::vec3 &) { return type == GL_FLOAT_VEC3; }
+bool uniformTypeMatches(GLenum type, const glm::vec4 &) { return type == GL_FLOAT_VEC4; }
+bool uniformTypeMatches(GLenum type, const glm::mat4 &) { return type == GL_FLOAT_MAT4; }
+bool uniformTypeMatches(GLenum type, const Sampler &)
+{
+    return type == GL_SAMPLER_2D || type == GL_SAMPLER_2D_ARRAY
+        || type == GL_SAMPLER_3D || type == GL_SAMPLER_CUBE;
+}
+
+void uniformValue(GLint loc, const GLint &value)     { glUniform1i(loc, value); }
+void uniformValue(GLint loc, const GLfloat &value)   { glUniform1f(loc, value); }
+void uniformValue(GLint loc, const glm::vec2 &value) { glUniform2fv(loc, 1, glm::value_ptr(value)); }
+void uniformValue(GLint loc, const glm::vec3 &value) { glUniform3fv(loc, 1, glm::value_ptr(value)); }
+void uniformValue(GLint loc, const glm::vec4 &value) { glUniform4fv(loc, 1, glm::value_ptr(value)); }
+void uniformValue(GLint loc, const glm::mat4 &value) { glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(value)); }
+void uniformValue(GLint loc, const Sampler &value)   { glUniform1i(loc, value.unit); }
+
+// Uniforms the shader doesn't have (or the compiler optimized out)
+// are silently skipped, the same as GL does for location -1.
+template <typename T>
+void set(const Shader &shader, Uniform<T> uniform, const T &value)
+{
+    auto info = shader.uniforms.find(uniform.hash);
+    if (info == shader.uniforms.end()) return;
+    assert(uniformTypeMatches(info->second.type, value) && "Uniform set with the wrong type");
+    use(shader);
+    uniformValue(info->second.location, value);
+}
+
+void initTransformationMatrices(Shader &shader)
+{
+    shader._model = uniformLocation(shader, MODEL_UNIFORM.hash);
+    shader._view = uniformLocation(shader, VIEW_UNIFORM.hash);
+    shader._projection = uniformLocation(shader, PROJECTION_UNIFORM.hash);
+}
+
+void setModelTransform(const Shader &shader, const glm::mat4 &mat)
+{
+    use(shader);
+    glUniformMatrix4fv(shader._model, 1, GL_FALSE, glm::value_ptr(mat));
+}
+
+void setCameraTransform(const Shader &shader, const glm::mat4 &mat)
+{
+    use(shader);
+    glUniformMatrix4fv(shader._view, 1, GL_FALSE, glm::value_ptr(mat));
+}
+
+void setProjectionTransform(const Shader &shader, const glm::mat4 &mat)
+{
+    use(shader);
+    glUniformMatrix4fv(shader._projection, 1, GL_FALSE, glm::value_ptr(mat));
+}
+
+void setColorUniform(const Shader &shader, const char *name, glm::vec3 color)
+{
+    GLint loc = uniformLocation(shader, hashName(name));
+    use(shader);
+    glUniform3fv(loc, 1, glm::value_ptr(color));
+}
+
+void setHasTexture(Shader &shader)
+{
+    set(shader, TEX_UNIFORM, Sampler{0});
+}
+
+// Uploads the frame's constants once; every shader sees them through
+// FRAME_CONSTANTS_BINDING.
+void updateFrameConstants(FrameConstantsBuffer &frame_buffer, const FrameConstants &constants)
+{
+    if (!frame_buffer.buffer)
+    {
+        glGenBuffers(1, &frame_buffer.buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, frame_buffer.buffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameConstants), nullptr, GL_DYNAMIC_DRAW);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, frame_buffer.buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameConstants), &constants);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_CONSTANTS_BINDING, frame_buffer.buffer);
+}
+
+// False when the frame's section is already full.
+bool updateFrameConstants(StreamRing &ring, const FrameConstants &constants)
+{
+    GLsizeiptr offset = write(ring, &constants, sizeof(FrameConstants));
+    if (offset < 0) return false;
+    glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_CONSTANTS_BINDING, ring.buffer, offset, sizeof(FrameConstants));
+    return true;
+}
+
+FrameConstantsBuffer::~FrameConstantsBuffer()
+{
+    if (!isContextActive()) return;
+    if (!buffer) return;
+    glDeleteBuffers(1, &buffer);
+}
+
+Shader::~Shader()
+{
+    if (!isContextActive()) return;
+    if (!id) return;
+    // Programs loaded from a binary have no shader objects.
+    if (vertex)
+    {
+        glDetachShader(id, vertex);
+        glDeleteShader(vertex);
+    }
+    if (fragment)
+    {
+        glDetachShader(id, fragment);
+        glDeleteShader(fragment);
+    }
+    forgetProgram(id);
+    glDeleteProgram(id);
+}
+
+Result<MappedFile> mapFile(const std::string &path)
+{
+    MappedFile mapped;
+#ifdef _WIN32
+    mapped.file = CreateFileA(
+        path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (mapped.file == INVALID_HANDLE_VALUE)
+        return errorResult<MappedFile>("Could not open " + path);
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mapped.file, &size))
+        return errorResult<MappedFile>("Could not get the size of " + path);
+    mapped.size = static_cast<size_t>(size.QuadPart);
+    if (mapped.size == 0) return successfulResult(std::move(mapped));
+    mapped.mapping = CreateFileMappingA(mapped.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapped.mapping)
+        return errorResult<MappedFile>("Could not map " + path);
+    mapped.data = static_cast<const unsigned char*>(MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return errorResult<MappedFile>("Could not open " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return errorResult<MappedFile>("Could not get the size of " + path);
+    }
+    mapped.size = static_cast<size_t>(info.st_size);
+    if (mapped.size == 0)
+    {
+        close(fd);
+        return successfulResult(std::move(mapped));
+    }
+    void *view = mmap(nullptr, mapped.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive on its own.
+    close(fd);
+    if (view != MAP_FAILED) mapped.data = static_cast<const unsigned char*>(view);
+#endif
+    if (!mapped.data)
+        return errorResult<MappedFile>("Could not map " + path);
+    return successfulResult(std::move(mapped));
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (data) munmap(const_cast<unsigned char*>(data), size);
+#endif
+}
+
+// The pool and worker the current thread belongs to, if any.
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local int current_worker = -1;
+// Jobs run while waiting nest inside the waiting job's time.
+static thread_local int job_depth = 0;
+
+double millisecondsBetween(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+// worker is -1 when the caller isn't one of the pool's threads, like a
+// thread helping out while it waits.
+bool takeJob(ThreadPool &pool, int worker, Job &job)
+{
+    if (pool.queued == 0) return false;
+    if (worker >= 0)
+    {
+        WorkerQueue &own = *pool.queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.jobs.empty())
+        {
+            job = std::move(own.jobs.back());
+            own.jobs.pop_back();
+            pool.queued--;
+            return true;
+        }
+    }
+    size_t num_queues = pool.queues.size();
+    size_t first = worker >= 0 ? worker + 1 : 0;
+    for (size_t i = 0; i < num_queues; i++)
+    {
+        WorkerQueue &victim = *pool.queues[(first + i) % num_queues];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.jobs.empty()) continue;
+        job = std::move(victim.jobs.front());
+        victim.jobs.pop_front();
+        pool.queued--;
+        return true;
+    }
+    return false;
+}
+
+long long nanosecondsSince(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count();
+}
+
+void runJob(ThreadPool &pool, int worker, Job &job)
+{
+    auto start = std::chrono::steady_clock::now();
+    bool counted = worker >= 0 && job_depth == 0;
+    if (counted) pool.running_since_ns[worker] = nanosecondsSince(pool.started, start);
+    job_depth++;
+    job.run();
+    job_depth--;
+    auto end = std::chrono::steady_clock::now();
+    // Whatever takeWorkerUtilization hasn't already taken.
+    if (counted)
+    {
+        long long since = pool.running_since_ns[worker].exchange(-1);
+        pool.busy_ns[worker] += std::max(0LL, nanosecondsSince(pool.started, end) - since);
+    }
+    if (pool.profile_hook)
+        pool.profile_hook(job.name, worker, millisecondsBetween(pool.started, start), millisecondsBetween(start, end));
+    // Last, since whoever waits on the counter may be gone right after.
+    if (job.counter && --job.counter->unfinished == 0)
+    {
+        { std::lock_guard<std::mutex> lock(pool.mutex); }
+        pool.wake_waiter.notify_all();
+    }
+}
+
+void runWorker(ThreadPool *pool, int worker)
+{
+    current_pool = pool;
+    current_worker = worker;
+    Job job;
+    while (true)
+    {
+        if (takeJob(*pool, worker, job))
+        {
+            runJob(*pool, worker, job);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        if (pool->stopping && pool->queued == 0) return; // nothing left to do
+        pool->wake_worker.wait(lock, [&] { return pool->stopping || pool->queued > 0; });
+    }
+}
+
+ThreadPool::ThreadPool(int num_threads)
+{
+    started = utilization_since = std::chrono::steady_clock::now();
+    busy_ns.reset(new std::atomic<long long>[num_threads]);
+    running_since_ns.reset(new std::atomic<long long>[num_threads]);
+    for (int i = 0; i < num_threads; i++)
+    {
+        busy_ns[i] = 0;
+        running_since_ns[i] = -1;
+        queues.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (int i = 0; i < num_threads; i++) workers.emplace_back(runWorker, this, i);
+}
+
+// Queued jobs still run before the workers exit.
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake_worker.notify_all();
+    for (auto &worker : workers) worker.join();
+}
+
+// From a worker, the job goes on that worker's own deque.
+void spawn(ThreadPool &pool, std::function<void()> run, JobCounter *counter = nullptr, const char *name = "job")
+{
+    if (counter) counter->unfinished++;
+    bool on_worker = current_pool == &pool && current_worker >= 0;
+    size_t index = on_worker ? current_worker : pool.next_queue++ % pool.queues.size();
+    {
+        WorkerQueue &queue = *pool.queues[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.jobs.push_back(Job {std::move(run), counter, name});
+    }
+    pool.queued++;
+    // Taking the lock orders this against a worker about to sleep.
+    { std::lock_guard<std::mutex> lock(pool.mutex); }
+    pool.wake_worker.notify_one();
+    pool.wake_waiter.notify_all();
+}
+
+// Runs other jobs while it waits, so jobs can wait on their children
+// without tying up a worker. With nothing to take it spins briefly, then
+// sleeps until a job is spawned or a counter drains.
+void wait(ThreadPool &pool, JobCounter &counter)
+{
+    const int MAX_SPINS = 64;
+    int worker = current_pool == &pool ? current_worker : -1;
+    Job job;
+    int spins = 0;
+    while (counter.unfinished > 0)
+    {
+        if (takeJob(pool, worker, job))
+        {
+            runJob(pool, worker, job);
+            spins = 0;
+        }
+        else if (spins < MAX_SPINS)
+        {
+            spins++;
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.wake_waiter.wait(lock, [&] { return counter.unfinished == 0 || pool.queued > 0; });
+        }
+    }
+}
+
+// Calls body(chunk_begin, chunk_end) over [begin, end) in chunks of
+// grain, spread over the pool, and returns when all are done. The
+// calling thread pitches in.
+template <typename Body>
+void parallelFor(ThreadPool &pool, size_t begin, size_t end, size_t grain, Body body, const char *name = "parallel_for")
+{
+    grain = std::max<size_t>(grain, 1);
+    JobCounter counter;
+    for (size_t chunk = begin; chunk < end; chunk += grain)
+    {
+        size_t chunk_end = std::min(end, chunk + grain);
+        spawn(pool, [&body, chunk, chunk_end] { body(chunk, chunk_end); }, &counter, name);
+    }
+    wait(pool, counter);
+}
+
+// Fraction of the time since the last call each worker spent in jobs.
+std::vector<float> takeWorkerUtilization(ThreadPool &pool)
+{
+    auto now = std::chrono::steady_clock::now();
+    double elapsed_ns = std::chrono::duration<double, std::nano>(now - pool.utilization_since).count();
+    pool.utilization_since = now;
+    long long now_ns = nanosecondsSince(pool.started, now);
+    std::vector<float> utilization;
+    for (size_t i = 0; i < pool.workers.size(); i++)
+    {
+        // A job still running gets the time it has run so far; the rest
+        // is credited when it finishes.
+        long long since = pool.running_since_ns[i];
+        while (since >= 0 && since < now_ns
+            && !pool.running_since_ns[i].compare_exchange_weak(since, now_ns)) {}
+        if (since >= 0 && since < now_ns) pool.busy_ns[i] += now_ns - since;
+        double busy = static_cast<double>(pool.busy_ns[i].exchange(0));
+        utilization.push_back(elapsed_ns > 0 ? static_cast<float>(std::min(1.0, busy / elapsed_ns)) : 0.f);
+    }
+    return utilization;
+}
+
+ProfileScope::ProfileScope(ThreadPool &pool, const char *name)
+    : pool(pool), name(name), start(std::chrono::steady_clock::now())
+{
+}
+
+ProfileScope::~ProfileScope()
+{
+    if (!pool.profile_hook) return;
+    auto end = std::chrono::steady_clock::now();
+    int worker = current_pool == &pool ? current_worker : -1;
+    pool.profile_hook(name, worker, millisecondsBetween(pool.started, start), millisecondsBetween(start, end));
+}
+
+template <typename F>
+auto runAsync(ThreadPool &pool, F function, const char *name = "async") -> std::future<decltype(function())>
+{
+    auto task = std::make_shared<std::packaged_task<decltype(function())()>>(std::move(function));
+    auto future = task->get_future();
+    spawn(pool, [task] { (*task)(); }, nullptr, name);
+    return future;
+}
+
+static AssetPack asset_pack;
+
+// LZ77 in LZ4's block layout: a token holding the literal and match
+// lengths, the literals, then a 16-bit distance back to the match. The
+// last sequence has literals only.
+constexpr size_t LZ_MIN_MATCH = 4;
+constexpr int LZ_HASH_BITS = 14;
+
+void writeLZLength(std::vector<unsigned char> &out, size_t length)
+{
+    for (; length >= 255; length -= 255) out.push_back(255);
+    out.push_back(static_cast<unsigned char>(length));
+}
+
+std::vector<unsigned char> lzCompress(const unsigned char *data, size_t size)
+{
+    std::vector<unsigned char> out;
+    out.reserve(size / 2 + 16);
+    std::vector<size_t> last_seen(size_t(1) << LZ_HASH_BITS, SIZE_MAX);
+    size_t literal_start = 0;
+    size_t i = 0;
+    auto emitSequence = [&](size_t match_length, size_t distance)
+    {
+        size_t literals = i - literal_start;
+        size_t extra = match_length ? match_length - LZ_MIN_MATCH : 0;
+        out.push_back(static_cast<unsigned char>(std::min<size_t>(literals, 15) << 4 | std::min<size_t>(extra, 15)));
+        if (literals >= 15) writeLZLength(out, literals - 15);
+        out.insert(out.end(), data + literal_start, data + i);
+        if (!match_length) return;
+        out.push_back(static_cast<unsigned char>(distance & 0xff));
+        out.push_back(static_cast<unsigned char>(distance >> 8));
+        if (extra >= 15) writeLZLength(out, extra - 15);
+    };
+    while (i + LZ_MIN_MATCH <= size)
+    {
+        std::uint32_t next4;
+        std::memcpy(&next4, data + i, sizeof(next4));
+        size_t &slot = last_seen[(next4 * 2654435761u) >> (32 - LZ_HASH_BITS)];
+        size_t candidate = slot;
+        slot = i;
+        if (candidate == SIZE_MAX || i - candidate > 65535 || std::memcmp(data + candidate, data + i, LZ_MIN_MATCH) != 0)
+        {
+            i++;
+            continue;
+        }
+        size_t length = LZ_MIN_MATCH;
+        while (i + length < size && data[candidate + length] == data[i + length]) length++;
+        emitSequence(length, i - candidate);
+        i += length;
+        literal_start = i;
+    }
+    i = size;
+    emitSequence(0, 0);
+    return out;
+}
+
+// False on anything malformed rather than reading or writing out of bounds.
+bool lzDecompress(const unsigned char *in, size_t in_size, unsigned char *out, size_t out_size)
+{
+    size_t in_at = 0, out_at = 0;
+    auto readLength = [&](size_t &length)
+    {
+        unsigned char byte;
+        do
+        {
+            if (in_at >= in_size) return false;
+            byte = in[in_at++];
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+    while (in_at < in_size)
+    {
+        unsigned char token = in[in_at++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !readLength(literals)) return false;
+        if (literals > in_size - in_at || literals > out_size - out_at) return false;
+        std::memcpy(out + out_at, in + in_at, literals);
+        in_at += literals;
+        out_at += literals;
+        if (in_at == in_size) break;
+
+        if (in_size - in_at < 2) return false;
+        size_t distance = in[in_at] | in[in_at + 1] << 8;
+        in_at += 2;
+        size_t length = token & 15;
+        if (length == 15 && !readLength(length)) return false;
+        length += LZ_MIN_MATCH;
+        if (distance == 0 || distance > out_at || length > out_size - out_at) return false;
+        // Matches may overlap what they produce, so copy a byte at a time.
+        for (size_t k = 0; k < length; k++, out_at++) out[out_at] = out[out_at - distance];
+    }
+    return out_at == out_size;
+}
+
+// Pack paths are relative to the working directory with forward slashes,
+// like "res/models/path.obj".
+std::string packPath(const std::string &path)
+{
+    return std::filesystem::path(path).lexically_normal().generic_string();
+}
+
+Result<bool> openAssetPack(const std::string &path)
+{
+    auto mappedResult = mapFile(path);
+    if (!mappedResult.success) return errorResult<bool>(mappedResult.error);
+    MappedFile &file = mappedResult.obj;
+
+    PackHeader header;
+    if (file.size < sizeof(header)) return errorResult<bool>(path + " is not an asset pack");
+    std::memcpy(&header, file.data, sizeof(header));
+    if (header.magic != PACK_MAGIC) return errorResult<bool>(path + " is not an asset pack");
+    if (header.version != PACK_VERSION) return errorResult<bool>(path + " was built by another version");
+    size_t paths_start = sizeof(header) + size_t(header.num_entries) * sizeof(PackEntry);
+    if (paths_start + header.paths_size > file.size) return errorResult<bool>(path + " is truncated");
+
+    const PackEntry *entries = reinterpret_cast<const PackEntry*>(file.data + sizeof(header));
+    for (std::uint32_t i = 0; i < header.num_entries; i++)
+    {
+        const PackEntry &entry = entries[i];
+        if (size_t(entry.path_offset) + entry.path_length > header.paths_size
+            || entry.offset > file.size || entry.stored_size > file.size - entry.offset
+            || (entry.compression == PackCompression::NONE && entry.stored_size != entry.size))
+            return errorResult<bool>(path + " has a corrupt index");
+    }
+#ifndef _WIN32
+    // Start reading the whole pack ahead instead of faulting asset by asset.
+    madvise(const_cast<unsigned char*>(file.data), file.size, MADV_WILLNEED);
+#endif
+    asset_pack.entries = entries;
+    asset_pack.num_entries = header.num_entries;
+    asset_pack.paths = reinterpret_cast<const char*>(file.data + paths_start);
+    asset_pack.file = std::move(file);
+    return successfulResult(true);
+}
+
+// Null when there's no pack open or the path isn't in it.
+const PackEntry *findAsset(const std::string &path)
+{
+    if (!asset_pack.entries) return nullptr;
+    std::string key = packPath(path);
+    std::uint64_t hash = hashBytes(key);
+    const PackEntry *end = asset_pack.entries + asset_pack.num_entries;
+    const PackEntry *entry = std::lower_bound(asset_pack.entries, end, hash,
+        [](const PackEntry &entry, std::uint64_t hash) { return entry.path_hash < hash; });
+    for (; entry != end && entry->path_hash == hash; entry++)
+    {
+        if (entry->path_length == key.size()
+            && std::memcmp(asset_pack.paths + entry->path_offset, key.data(), key.size()) == 0)
+            return entry;
+    }
+    return nullptr;
+}
+
+// Points straight into the pack for stored entries; compressed ones are
+// unpacked into scratch.
+bool assetBytes(const PackEntry &entry, const unsigned char *&bytes, size_t &size, std::vector<unsigned char> &scratch)
+{
+    const unsigned char *stored = asset_pack.file.data + entry.offset;
+    size = static_cast<size_t>(entry.size);
+    if (entry.compression == PackCompression::NONE)
+    {
+        bytes = stored;
+        return true;
+    }
+    scratch.resize(size);
+    bytes = scratch.data();
+    return entry.compression == PackCompression::LZ
+        && lzDecompress(stored, static_cast<size_t>(entry.stored_size), scratch.data(), size);
+}
+
+std::string loadFile(std::string fileName)
+{
+    if (const PackEntry *entry = findAsset(fileName))
+    {
+        const unsigned char *bytes;
+        size_t size;
+        std::vector<unsigned char> scratch;
+        if (!assetBytes(*entry, bytes, size, scratch)) return "";
+        return std::string(reinterpret_cast<const char*>(bytes), size);
+    }
+    auto fileStream = std::ifstream(fileName);
+    std::stringstream string_stream;
+    string_stream << fileStream.rdbuf();
+    std::string contents = string_stream.str();
+    return contents;
+}
+
+// loadFile reads loose text in text mode, so text assets are packed with
+// LF line endings to read back the same on every platform.
+bool isTextAsset(const std::filesystem::path &path)
+{
+    std::string extension = path.extension().string();
+    for (const char *text : {".obj", ".mtl", ".vert", ".frag", ".glsl"})
+        if (extension == text) return true;
+    return false;
+}
+
+// Packs every file under source_dir. Entries are LZ compressed when that
+// saves at least an eighth, which in practice means text; images are
+// already compressed and go in as they are.
+Result<bool> buildAssetPack(const std::string &source_dir, const std::string &pack_path)
+{
+    struct PackedFile
+    {
+        std::string path;
+        std::vector<unsigned char> payload;
+        PackEntry entry;
+    };
+    std::vector<PackedFile> files;
+    std::error_code error;
+    for (auto it = std::filesystem::recursive_directory_iterator(source_dir, error);
+         !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+    {
+        if (!it->is_regular_file()) continue;
+        PackedFile file;
+        file.path = packPath(it->path().string());
+        std::ifstream in(it->path(), std::ios::binary);
+        std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!in && !in.eof()) return errorResult<bool>("Could not read " + file.path);
+        if (isTextAsset(it->path()))
+            bytes.erase(std::remove(bytes.begin(), bytes.end(), '\r'), bytes.end());
+
+        const unsigned char *data = reinterpret_cast<const unsigned char*>(bytes.data());
+        file.entry = PackEntry();
+        file.entry.path_hash = hashBytes(file.path);
+        file.entry.content_hash = hashBytes(bytes);
+        file.entry.size = bytes.size();
+        file.payload = lzCompress(data, bytes.size());
+        if (file.payload.size() <= bytes.size() - bytes.size() / 8)
+            file.entry.compression = PackCompression::LZ;
+        else
+        {
+            file.payload.assign(data, data + bytes.size());
+            file.entry.compression = PackCompression::NONE;
+        }
+        file.entry.stored_size = file.payload.size();
+        files.push_back(std::move(file));
+    }
+    if (error) return errorResult<bool>("Could not list " + source_dir + ": " + error.message());
+
+    std::sort(files.begin(), files.end(), [](const PackedFile &a, const PackedFile &b)
+    {
+        return a.entry.path_hash < b.entry.path_hash;
+    });
+    std::string paths;
+    for (PackedFile &file : files)
+    {
+        file.entry.path_offset = static_cast<std::uint32_t>(paths.size());
+        file.entry.path_length = static_cast<std::uint32_t>(file.path.size());
+        paths += file.path;
+    }
+    auto align = [](std::uint64_t offset) { return (offset + PACK_ALIGNMENT - 1) / PACK_ALIGNMENT * PACK_ALIGNMENT; };
+    std::uint64_t offset = sizeof(PackHeader) + files.size() * sizeof(PackEntry) + paths.size();
+    for (PackedFile &file : files)
+    {
+        file.entry.offset = align(offset);
+        offset = file.entry.offset + file.entry.stored_size;
+    }
+
+    std::ofstream out(pack_path, std::ios::binary | std::ios::trunc);
+    if (!out) return errorResult<bool>("Could not create " + pack_path);
+    PackHeader header {PACK_MAGIC, PACK_VERSION,
+        static_cast<std::uint32_t>(files.size()), static_cast<std::uint32_t>(paths.size())};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const PackedFile &file : files)
+        out.write(reinterpret_cast<const char*>(&file.entry), sizeof(file.entry));
+    out.write(paths.data(), paths.size());
+    const char padding[PACK_ALIGNMENT] = {};
+    for (const PackedFile &file : files)
+    {
+        out.write(padding, file.entry.offset - out.tellp());
+        out.write(reinterpret_cast<const char*>(file.payload.data()), file.payload.size());
+    }
+    if (!out) return errorResult<bool>("Could not write " + pack_path);
+    return successfulResult(true);
+}
+
+// Tipsify (Sander et al. 2007): fans out from one vertex at a time and
+// moves on to whichever live vertex will still be in a FIFO cache of
+// cache_size entries, so the post-transform cache hits more often.
+void optimizeVertexCache(std::vector<GLuint> &indices, size_t num_vertices, int cache_size = 16)
+{
+    std::vector<size_t> first_use(num_vertices + 1, 0);
+    for (GLuint index : indices) first_use[index + 1]++;
+    for (size_t v = 0; v < num_vertices; v++) first_use[v + 1] += first_use[v];
+    std::vector<int> live(num_vertices);
+    for (size_t v = 0; v < num_vertices; v++) live[v] = static_cast<int>(first_use[v + 1] - first_use[v]);
+    std::vector<size_t> triangles_of(indices.size());
+    std::vector<size_t> fill(first_use.begin(), first_use.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++) triangles_of[fill[indices[i]]++] = i / 3;
+
+    std::vector<int> cache_time(num_vertices, 0);
+    std::vector<bool> emitted(indices.size() / 3, false);
+    std::vector<GLuint> dead_ends, candidates, optimized;
+    optimized.reserve(indices.size());
+    int time = cache_size + 1;
+    size_t cursor = 0;
+    long long fanning = num_vertices ? 0 : -1;
+    while (fanning >= 0)
+    {
+        candidates.clear();
+        for (size_t t = first_use[fanning]; t < first_use[fanning + 1]; t++)
+        {
+            size_t triangle = triangles_of[t];
+            if (emitted[triangle]) continue;
+            emitted[triangle] = true;
+            for (int corner = 0; corner < 3; corner++)
+            {
+                GLuint v = indices[3 * triangle + corner];
+                optimized.push_back(v);
+                dead_ends.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - cache_time[v] > cache_size) cache_time[v] = time++;
+            }
+        }
+        fanning = -1;
+        int best_priority = -1;
+        for (GLuint v : candidates)
+        {
+            if (live[v] <= 0) continue;
+            int age = time - cache_time[v];
+            int priority = age + 2 * live[v] <= cache_size ? age : 0;
+            if (priority > best_priority)
+            {
+                best_priority = priority;
+                fanning = v;
+            }
+        }
+        while (fanning < 0 && !dead_ends.empty())
+        {
+            GLuint v = dead_ends.back();
+            dead_ends.pop_back();
+            if (live[v] > 0) fanning = v;
+        }
+        for (; fanning < 0 && cursor < num_vertices; cursor++)
+            if (live[cursor] > 0) fanning = cursor;
+    }
+    indices.swap(optimized);
+}
+
+// Renumbers vertices in the order the indices first use them, so
+// fetches walk the vertex buffer forward.
+void optimizeVertexFetch(MeshData &mesh)
+{
+    size_t floats_per_vertex = vertexStride(mesh) / sizeof(GLfloat);
+    if (!floats_per_vertex) return;
+    std::vector<GLuint> remap(mesh.vertices.size() / floats_per_vertex, UINT32_MAX);
+    std::vector<GLfloat> vertices;
+    vertices.reserve(mesh.vertices.size());
+    GLuint next = 0;
+    for (GLuint &index : mesh.indices)
+    {
+        if (remap[index] == UINT32_MAX)
+        {
+            remap[index] = next++;
+            auto vertex = mesh.vertices.begin() + index * floats_per_vertex;
+            vertices.insert(vertices.end(), vertex, vertex + floats_per_vertex);
+        }
+        index = remap[index];
+    }
+    mesh.vertices.swap(vertices);
+}
+
+// Line segment order means something to PathMesh, so only triangle
+// lists get their indices reordered.
+void optimizeMesh(MeshData &mesh)
+{
+    if (mesh.primitive_type == MeshPrimitiveType::TRIANGLES)
+    {
+        size_t floats_per_vertex = vertexStride(mesh) / sizeof(GLfloat);
+        if (floats_per_vertex) optimizeVertexCache(mesh.indices, mesh.vertices.size() / floats_per_vertex);
+    }
+    optimizeVertexFetch(mesh);
+}
+
+constexpr std::uint32_t MESH_MAGIC = 0x3148534d; // "MSH1"
+
+// Keyed by the OBJ's path and contents and the primitive type it's read as.
+std::string meshCachePath(const std::string &path, const std::string &obj_text, MeshPrimitiveType mode)
+{
+    std::string key = packPath(path) + '\0' + std::to_string(hashBytes(obj_text))
+        + '\0' + std::to_string(static_cast<int>(mode));
+    std::stringstream cache_path;
+    cache_path << MESH_CACHE_DIR << std::hex << hashBytes(key) << ".mesh";
+    return cache_path.str();
+}
+
+// False for anything that doesn't hold up, so importOBJ parses the OBJ
+// again: the counts have to fit in the file, the layout has positions,
+// and every index names a vertex.
+bool loadMeshData(const std::string &path, MeshData &mesh)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return false;
+    std::uint64_t file_size = static_cast<std::uint64_t>(file.tellg());
+    file.seekg(0);
+    std::uint32_t magic = 0, primitive_type = 0, num_floats = 0, num_indices = 0;
+    std::int32_t layout = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&layout), sizeof(layout));
+    file.read(reinterpret_cast<char*>(&primitive_type), sizeof(primitive_type));
+    file.read(reinterpret_cast<char*>(&num_floats), sizeof(num_floats));
+    file.read(reinterpret_cast<char*>(&num_indices), sizeof(num_indices));
+    if (!file || magic != MESH_MAGIC) return false;
+    if (!(layout & MeshLayout::POS) || layout & ~(MeshLayout::POS | MeshLayout::TEX | MeshLayout::NORM)) return false;
+    if (primitive_type > static_cast<std::uint32_t>(MeshPrimitiveType::LINE_SEGMENTS)) return false;
+    std::uint64_t header_size = static_cast<std::uint64_t>(file.tellg());
+    if ((std::uint64_t)num_floats * sizeof(GLfloat) + (std::uint64_t)num_indices * sizeof(GLuint) != file_size - header_size)
+        return false;
+    std::uint32_t floats_per_vertex = vertexStride(static_cast<char>(layout)) / sizeof(GLfloat);
+    if (num_floats % floats_per_vertex) return false;
+    std::uint32_t num_vertices = num_floats / floats_per_vertex;
+    mesh.layout = static_cast<char>(layout);
+    mesh.primitive_type = static_cast<MeshPrimitiveType>(primitive_type);
+    mesh.vertices.resize(num_floats);
+    mesh.indices.resize(num_indices);
+    file.read(reinterpret_cast<char*>(mesh.vertices.data()), num_floats * sizeof(GLfloat));
+    file.read(reinterpret_cast<char*>(mesh.indices.data()), num_indices * sizeof(GLuint));
+    if (!file) return false;
+    for (GLuint index : mesh.indices)
+        if (index >= num_vertices) return false;
+    return true;
+}
+
+void saveMeshData(const std::string &path, const MeshData &mesh)
+{
+    std::error_code error;
+    std::filesystem::create_directories(MESH_CACHE_DIR, error);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return;
+    std::int32_t layout = mesh.layout;
+    std::uint32_t primitive_type = static_cast<std::uint32_t>(mesh.primitive_type);
+    std::uint32_t num_floats = static_cast<std::uint32_t>(mesh.vertices.size());
+    std::uint32_t num_indices = static_cast<std::uint32_t>(mesh.indices.size());
+    file.write(reinterpret_cast<const char*>(&MESH_MAGIC), sizeof(MESH_MAGIC));
+    file.write(reinterpret_cast<const char*>(&layout), sizeof(layout));
+    file.write(reinterpret_cast<const char*>(&primitive_type), sizeof(primitive_type));
+    file.write(reinterpret_cast<const char*>(&num_floats), sizeof(num_floats));
+    file.write(reinterpret_cast<const char*>(&num_indices), sizeof(num_indices));
+    file.write(reinterpret_cast<const char*>(mesh.vertices.data()), num_floats * sizeof(GLfloat));
+    file.write(reinterpret_cast<const char*>(mesh.indices.data()), num_indices * sizeof(GLuint));
+}
+
+// Parses and optimizes an OBJ once per content and primitive type; later
+// loads, or every load after assetc has run, read the binary back from
+// MESH_CACHE_DIR.
+Result<MeshData> importOBJ(const std::string &path, const std::string &obj_text, MeshPrimitiveType mode)
+{
+    std::string cache_path = meshCachePath(path, obj_text, mode);
+    MeshData mesh;
+    if (loadMeshData(cache_path, mesh)) return successfulResult(std::move(mesh));
+    auto parseResult = loadOBJ(obj_text, mode);
+    if (!parseResult.success) return parseResult;
+    optimizeMesh(parseResult.obj);
+    saveMeshData(cache_path, parseResult.obj);
+    return parseResult;
+}
+
+Result<MeshData> importOBJ(const std::string &path, MeshPrimitiveType mode = MeshPrimitiveType::TRIANGLES)
+{
+    return importOBJ(path, loadFile(path), mode);
+}
+
+// Decodes straight out of the asset pack or a mapping of the file, so
+// the encoded bytes are never copied into a stdio buffer first.
+Image::Image(const char *filename)
+{
+    path = IMAGE_DIR;
+    path += filename;
+    data = nullptr;
+    width = height = channels = 0;
+    const unsigned char *bytes = nullptr;
+    size_t size = 0;
+    std::vector<unsigned char> unpacked;
+    MappedFile mapped;
+    if (const PackEntry *entry = findAsset(path))
+    {
+        if (!assetBytes(*entry, bytes, size, unpacked)) return;
+        content_hash = entry->content_hash;
+    }
+    else
+    {
+        auto mappedResult = mapFile(path);
+        if (!mappedResult.success) return;
+        mapped = std::move(mappedResult.obj);
+        bytes = mapped.data;
+        size = mapped.size;
+        std::error_code error;
+        source_time = std::filesystem::last_write_time(path, error);
+        from_file = !error;
+    }
+    if (size == 0) return;
+    data = stbi_load_from_memory(bytes, static_cast<int>(size), &width, &height, &channels, 0);
+    owns_data = data != nullptr;
+}
+
+Image::Image(const std::string &path, const unsigned char *bytes, size_t size)
+    : path(path), data(nullptr), width(0), height(0), channels(0)
+{
+    std::error_code error;
+    source_time = std::filesystem::last_write_time(path, error);
+    from_file = !error;
+    data = stbi_load_from_memory(bytes, static_cast<int>(size), &width, &height, &channels, 0);
+    owns_data = data != nullptr;
+}
+
+void freePixels(Image &image)
+{
+    if (image.owns_data) stbi_image_free(image.data);
+    image.data = nullptr;
+    image.owns_data = false;
+}
+
+Image::Image(int width, int height, int channels, unsigned char *data)
+    : data(data), width(width), height(height), channels(channels)
+{
+}
+
+bool isCodecSupported(TextureCodec codec)
+{
+    if (codec == TextureCodec::BC7)
+        return GLEW_VERSION_4_2 || GLEW_ARB_texture_compression_bptc;
+    return GLEW_EXT_texture_compression_s3tc;
+}
+
+GLenum compressedFormat(TextureCodec codec)
+{
+    if (codec == TextureCodec::BC1) return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    if (codec == TextureCodec::BC3) return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    return GL_COMPRESSED_RGBA_BPTC_UNORM;
+}
+
+// Images keep the channel count of their file, so monochrome ink
+// layers cost one byte per pixel instead of four.
+GLenum pixelFormat(int channels)
+{
+    static const GLenum formats[] = {GL_RED, GL_RG, GL_RGB, GL_RGBA};
+    assert(channels >= 1 && channels <= 4);
+    return formats[channels - 1];
+}
+
+GLenum internalFormat(int channels)
+{
+    static const GLenum formats[] = {GL_R8, GL_RG8, GL_RGB8, GL_RGBA8};
+    assert(channels >= 1 && channels <= 4);
+    return formats[channels - 1];
+}
+
+GLenum textureFormat(const Image &image)
+{
+    return pixelFormat(image.channels);
+}
+
+// Gray and gray+alpha textures still sample as RGBA in shaders.
+void setChannelSwizzle(GLenum target, int channels)
+{
+    GLint gray[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+    GLint gray_alpha[] = {GL_RED, GL_RED, GL_RED, GL_GREEN};
+    if (channels == 1) glTexParameteriv(target, GL_TEXTURE_SWIZZLE_RGBA, gray);
+    else if (channels == 2) glTexParameteriv(target, GL_TEXTURE_SWIZZLE_RGBA, gray_alpha);
+}
+
+bool hasAlpha(int channels)
+{
+    return channels == 2 || channels == 4;
+}
+
+// The pixel at index expanded to RGBA, gray going to all three colors.
+std::array<unsigned char, 4> rgbaAt(const unsigned char *pixels, size_t index, int channels)
+{
+    const unsigned char *pixel = pixels + index * channels;
+    if (channels == 1) return {pixel[0], pixel[0], pixel[0], 255};
+    if (channels == 2) return {pixel[0], pixel[0], pixel[0], pixel[1]};
+    if (channels == 3) return {pixel[0], pixel[1], pixel[2], 255};
+    return {pixel[0], pixel[1], pixel[2], pixel[3]};
+}
+
+GLsizeiptr imageDataSize(const Image &image)
+{
+    return static_cast<GLsizeiptr>(image.width) * image.height * image.channels;
+}
+
+Texture::Texture(const Image &image, const MipChain *mips)
+{
+    bool mipmapped = mips && !mips->levels.empty();
+    glGenTextures(1, &id);
+    bindTexture(GL_TEXTURE0, GL_TEXTURE_2D, id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mipmapped ? GL_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    GLenum format = textureFormat(image);
+    GLenum internal_format = internalFormat(image.channels);
+    setChannelSwizzle(GL_TEXTURE_2D, image.channels);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, image.width, image.height, 0, format, GL_UNSIGNED_BYTE, image.data);
+    if (!mipmapped)
+    {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        return;
+    }
+    GLint level = 1;
+    for (const MipLevel &mip : mips->levels)
+    {
+        assert(mips->channels == image.channels);
+        glTexImage2D(GL_TEXTURE_2D, level++, internal_format, mip.width, mip.height, 0, format, GL_UNSIGNED_BYTE, mip.pixels.data());
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+}
+
+Texture::Texture(const CompressedImage &image)
+{
+    assert(!image.levels.empty() && isCodecSupported(image.codec));
+    bool mipmapped = image.levels.size() > 1;
+    glGenTextures(1, &id);
+    bindTexture(GL_TEXTURE0, GL_TEXTURE_2D, id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mipmapped ? GL_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    GLint level = 0;
+    for (const CompressedLevel &compressed : image.levels)
+    {
+        glCompressedTexImage2D(
+            GL_TEXTURE_2D, level++, compressedFormat(image.codec),
+            compressed.width, compressed.height, 0,
+            static_cast<GLsizei>(compressed.blocks.size()), compressed.blocks.data());
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+}
+
+Texture::~Texture()
+{
+    if (!isContextActive()) return;
+    if (upload_wanted) *upload_wanted = false;
+    if (!id) return;
+    forgetTexture(id);
+    glDeleteTextures(1, &id);
+}
+
+// Mip generation works on linear light, four floats per pixel, so
+// dark ink lines don't get washed out the way averaging sRGB values would.
+
+const float *srgbToLinearTable()
+{
+    static const std::array<float, 256> table = []
+    {
+        std::array<float, 256> table;
+        for (int i = 0; i < 256; i++)
+        {
+            float c = i / 255.f;
+            table[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return table;
+    }();
+    return table.data();
+}
+
+constexpr int LINEAR_TO_SRGB_STEPS = 4096;
+
+unsigned char linearToSrgb(float linear)
+{
+    static const std::array<unsigned char, LINEAR_TO_SRGB_STEPS + 1> table = []
+    {
+        std::array<unsigned char, LINEAR_TO_SRGB_STEPS + 1> table;
+        for (int i = 0; i <= LINEAR_TO_SRGB_STEPS; i++)
+        {
+            float c = static_cast<float>(i) / LINEAR_TO_SRGB_STEPS;
+            float srgb = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1 / 2.4f) - 0.055f;
+            table[i] = static_cast<unsigned char>(srgb * 255.f + 0.5f);
+        }
+        return table;
+    }();
+    linear = glm::clamp(linear, 0.f, 1.f);
+    return table[static_cast<int>(linear * LINEAR_TO_SRGB_STEPS + 0.5f)];
+}
+
+#if COMIC_SSE
+typedef __m128 Pixel4;
+inline Pixel4 loadPixel(const float *p) { return _mm_loadu_ps(p); }
+inline void storePixel(float *p, Pixel4 v) { _mm_storeu_ps(p, v); }
+inline Pixel4 zeroPixel() { return _mm_setzero_ps(); }
+inline Pixel4 addPixels(Pixel4 a, Pixel4 b) { return _mm_add_ps(a, b); }
+inline Pixel4 scalePixel(Pixel4 a, float w) { return _mm_mul_ps(a, _mm_set1_ps(w)); }
+#else
+typedef glm::vec4 Pixel4;
+inline Pixel4 loadPixel(const float *p) { return glm::vec4(p[0], p[1], p[2], p[3]); }
+inline void storePixel(float *p, Pixel4 v) { p[0] = v.x; p[1] = v.y; p[2] = v.z; p[3] = v.w; }
+inline Pixel4 zeroPixel() { return glm::vec4(0.f); }
+inline Pixel4 addPixels(Pixel4 a, Pixel4 b) { return a + b; }
+inline Pixel4 scalePixel(Pixel4 a, float w) { return a * w; }
+#endif
+
+struct LinearImage
+{
+    int width;
+    int height;
+    std::vector<float> pixels;
+};
+
+LinearImage toLinear(const unsigned char *pixels, int channels, int width, int height)
+{
+    const float *to_linear = srgbToLinearTable();
+    LinearImage image {width, height, std::vector<float>(4 * width * height)};
+    for (int i = 0; i < width * height; i++)
+    {
+        auto rgba = rgbaAt(pixels, i, channels);
+        image.pixels[4*i + 0] = to_linear[rgba[0]];
+        image.pixels[4*i + 1] = to_linear[rgba[1]];
+        image.pixels[4*i + 2] = to_linear[rgba[2]];
+        image.pixels[4*i + 3] = rgba[3] / 255.f;
+    }
+    return image;
+}
+
+// Back to 8 bits, keeping only the channels the source image had.
+MipLevel toMipLevel(const LinearImage &image, int channels)
+{
+    MipLevel level {image.width, image.height, std::vector<unsigned char>(channels * image.width * image.height)};
+    for (int i = 0; i < image.width * image.height; i++)
+    {
+        const float *pixel = &image.pixels[4*i];
+        unsigned char *out = &level.pixels[channels*i];
+        unsigned char alpha = static_cast<unsigned char>(glm::clamp(pixel[3], 0.f, 1.f) * 255.f + 0.5f);
+        out[0] = linearToSrgb(pixel[0]);
+        if (channels == 2) out[1] = alpha;
+        if (channels >= 3)
+        {
+            out[1] = linearToSrgb(pixel[1]);
+            out[2] = linearToSrgb(pixel[2]);
+        }
+        if (channels == 4) out[3] = alpha;
+    }
+    return level;
+}
+
+LinearImage boxDownsample(const LinearImage &src)
+{
+    int width = std::max(1, src.width / 2), height = std::max(1, src.height / 2);
+    LinearImage dst {width, height, std::vector<float>(4 * width * height)};
+    for (int y = 0; y < height; y++)
+    {
+        const float *row0 = &src.pixels[4 * src.width * std::min(2*y, src.height - 1)];
+        const float *row1 = &src.pixels[4 * src.width * std::min(2*y + 1, src.height - 1)];
+        for (int x = 0; x < width; x++)
+        {
+            int x0 = 4 * std::min(2*x, src.width - 1);
+            int x1 = 4 * std::min(2*x + 1, src.width - 1);
+            Pixel4 sum = addPixels(
+                addPixels(loadPixel(row0 + x0), loadPixel(row0 + x1)),
+                addPixels(loadPixel(row1 + x0), loadPixel(row1 + x1)));
+            storePixel(&dst.pixels[4 * (y * width + x)], scalePixel(sum, 0.25f));
+        }
+    }
+    return dst;
+}
+
+constexpr int KAISER_TAPS = 8;
+
+// Windowed sinc for halving, sampled at the source pixels around each
+// destination pixel center.
+const std::array<float, KAISER_TAPS> &kaiserWeights()
+{
+    static const std::array<float, KAISER_TAPS> weights = []
+    {
+        auto besselI0 = [](float x)
+        {
+            float sum = 1.f, term = 1.f;
+            for (int k = 1; k < 20; k++)
+            {
+                term *= (x / (2.f * k)) * (x / (2.f * k));
+                sum += term;
+            }
+            return sum;
+        };
+        const float beta = 4.f;
+        const float radius = KAISER_TAPS / 2.f;
+        std::array<float, KAISER_TAPS> weights;
+        float total = 0;
+        for (int i = 0; i < KAISER_TAPS; i++)
+        {
+            float d = i - KAISER_TAPS / 2 + 0.5f;
+            float x = glm::pi<float>() * d / 2.f;
+            float sinc = std::sin(x) / x;
+            float window = besselI0(beta * std::sqrt(1.f - (d / radius) * (d / radius))) / besselI0(beta);
+            weights[i] = sinc * window;
+            total += weights[i];
+        }
+        for (float &weight : weights) weight /= total;
+        return weights;
+    }();
+    return weights;
+}
+
+// Halves one axis. Edges wrap, matching the GL_REPEAT the textures use.
+LinearImage kaiserDownsampleAxis(const LinearImage &src, bool horizontal)
+{
+    int src_length = horizontal ? src.width : src.height;
+    if (src_length == 1) return src;
+    int width = horizontal ? src.width / 2 : src.width;
+    int height = horizontal ? src.height : src.height / 2;
+    LinearImage dst {width, height, std::vector<float>(4 * width * height)};
+    const auto &weights = kaiserWeights();
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int center = 2 * (horizontal ? x : y);
+            Pixel4 sum = zeroPixel();
+            for (int i = 0; i < KAISER_TAPS; i++)
+            {
+                int s = center + i - KAISER_TAPS / 2 + 1;
+                s = ((s % src_length) + src_length) % src_length;
+                int sx = horizontal ? s : x, sy = horizontal ? y : s;
+                sum = addPixels(sum, scalePixel(loadPixel(&src.pixels[4 * (sy * src.width + sx)]), weights[i]));
+            }
+            storePixel(&dst.pixels[4 * (y * width + x)], sum);
+        }
+    }
+    return dst;
+}
+
+// Each level is filtered from the previous one in float, without
+// going through 8 bits in between.
+MipChain generateMipChain(const Image &image, MipFilter filter)
+{
+    MipChain chain;
+    chain.filter = filter;
+    chain.channels = image.channels;
+    if (filter == MipFilter::NONE || !image.data) return chain;
+    LinearImage level = toLinear(image.data, image.channels, image.width, image.height);
+    while (level.width > 1 || level.height > 1)
+    {
+        if (filter == MipFilter::BOX) level = boxDownsample(level);
+        else level = kaiserDownsampleAxis(kaiserDownsampleAxis(level, true), false);
+        chain.levels.push_back(toMipLevel(level, chain.channels));
+    }
+    return chain;
+}
+
+constexpr std::uint32_t MIP_CHAIN_MAGIC = 0x3250494d; // "MIP2"
+
+// Hashes a loose file only once a cache key asks for it, since most loads
+// never do. 0, so nothing gets cached, when the file has been written
+// since it was decoded. Not safe to call on one image from two threads.
+std::uint64_t contentHash(const Image &image)
+{
+    if (image.content_hash || !image.from_file) return image.content_hash;
+    std::error_code error;
+    if (std::filesystem::last_write_time(image.path, error) != image.source_time || error) return 0;
+    auto mappedResult = mapFile(image.path);
+    if (!mappedResult.success) return 0;
+    image.content_hash = hashBytes(mappedResult.obj.data, mappedResult.obj.size);
+    return image.content_hash;
+}
+
+// Identifies the file an image was decoded from by its path and contents,
+// for caches of things derived from it. Touching a file without changing
+// it keeps its caches, and assetc's output matches what the game looks up.
+std::string sourceFileKey(const Image &image)
+{
+    std::uint64_t content_hash = contentHash(image);
+    if (!content_hash) return "";
+    return packPath(image.path) + '\0' + std::to_string(content_hash) + '\0';
+}
+
+std::string mipCachePath(const Image &image, MipFilter filter)
+{
+    std::string key = sourceFileKey(image);
+    if (key.empty()) return "";
+    key += std::to_string(static_cast<int>(filter));
+    std::stringstream path;
+    path << MIP_CACHE_DIR << std::hex << hashBytes(key) << ".mips";
+    return path.str();
+}
+
+bool loadMipChain(const std::string &path, MipChain &chain)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::uint32_t magic = 0, num_levels = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&chain.channels), sizeof(chain.channels));
+    file.read(reinterpret_cast<char*>(&num_levels), sizeof(num_levels));
+    if (!file || magic != MIP_CHAIN_MAGIC || chain.channels < 1 || chain.channels > 4) return false;
+    chain.levels.resize(num_levels);
+    for (MipLevel &level : chain.levels)
+    {
+        file.read(reinterpret_cast<char*>(&level.width), sizeof(level.width));
+        file.read(reinterpret_cast<char*>(&level.height), sizeof(level.height));
+        if (!file || level.width <= 0 || level.height <= 0) return false;
+        level.pixels.resize(chain.channels * level.width * level.height);
+        file.read(reinterpret_cast<char*>(level.pixels.data()), level.pixels.size());
+    }
+    return static_cast<bool>(file);
+}
+
+void saveMipChain(const std::string &path, const MipChain &chain)
+{
+    std::error_code error;
+    std::filesystem::create_directories(MIP_CACHE_DIR, error);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return;
+    std::uint32_t num_levels = static_cast<std::uint32_t>(chain.levels.size());
+    file.write(reinterpret_cast<const char*>(&MIP_CHAIN_MAGIC), sizeof(MIP_CHAIN_MAGIC));
+    file.write(reinterpret_cast<const char*>(&chain.channels), sizeof(chain.channels));
+    file.write(reinterpret_cast<const char*>(&num_levels), sizeof(num_levels));
+    for (const MipLevel &level : chain.levels)
+    {
+        file.write(reinterpret_cast<const char*>(&level.width), sizeof(level.width));
+        file.write(reinterpret_cast<const char*>(&level.height), sizeof(level.height));
+        file.write(reinterpret_cast<const char*>(level.pixels.data()), level.pixels.size());
+    }
+}
+
+// Builds the chain once per source file and filter; later runs read it
+// back from MIP_CACHE_DIR.
+MipChain importMipChain(const Image &image, MipFilter filter)
+{
+    if (filter == MipFilter::NONE) return MipChain();
+    std::string cache_path = mipCachePath(image, filter);
+    MipChain chain;
+    chain.filter = filter;
+    if (!cache_path.empty() && loadMipChain(cache_path, chain)) return chain;
+    chain = generateMipChain(image, filter);
+    if (!cache_path.empty()) saveMipChain(cache_path, chain);
+    return chain;
+}
+
+TextureArray::TextureArray(const std::vector<const Image*> &images, MipFilter mip_filter)
+{
+    assert(!images.empty());
+    width = images[0]->width;
+    height = images[0]->height;
+    layers = static_cast<int>(images.size());
+    int channels = images[0]->channels;
+    std::vector<MipChain> mips;
+    for (const Image *image : images)
+    {
+        assert(image->width == width && image->height == height && "Texture array layers must match in size");
+        assert(image->channels == channels && "Texture array layers must match in channels");
+        mips.push_back(importMipChain(*image, mip_filter));
+    }
+    GLint num_levels = 1 + static_cast<GLint>(mips[0].levels.size());
+
+    glGenTextures(1, &id);
+    bindTexture(GL_TEXTURE0, GL_TEXTURE_2D_ARRAY, id);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, num_levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, num_levels > 1 ? GL_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, num_levels - 1);
+    setChannelSwizzle(GL_TEXTURE_2D_ARRAY, channels);
+    int level_width = width, level_height = height;
+    for (GLint level = 0; level < num_levels; level++)
+    {
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat(channels), level_width, level_height, layers, 0, pixelFormat(channels), GL_UNSIGNED_BYTE, nullptr);
+        for (int layer = 0; layer < layers; layer++)
+        {
+            const unsigned char *pixels = level == 0 ? images[layer]->data : mips[layer].levels[level - 1].pixels.data();
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, level_width, level_height, 1, pixelFormat(channels), GL_UNSIGNED_BYTE, pixels);
+        }
+        level_width = std::max(1, level_width / 2);
+        level_height = std::max(1, level_height / 2);
+    }
+}
+
+TextureArray::~TextureArray()
+{
+    if (!isContextActive()) return;
+    if (!id) return;
+    forgetTexture(id);
+    glDeleteTextures(1, &id);
+}
+
+typedef std::array<std::array<int, 4>, 16> Block;
+
+// Reads the 4x4 block at (bx, by), repeating edge pixels for images
+// whose size isn't a multiple of four.
+Block loadBlock(const unsigned char *pixels, int channels, int width, int height, int bx, int by)
+{
+    Block block;
+    for (int y = 0; y < 4; y++)
+    {
+        for (int x = 0; x < 4; x++)
+        {
+            int sx = std::min(4*bx + x, width - 1), sy = std::min(4*by + y, height - 1);
+            auto rgba = rgbaAt(pixels, sy * width + sx, channels);
+            for (int c = 0; c < 4; c++) block[4*y + x][c] = rgba[c];
+        }
+    }
+    return block;
+}
+
+// Projects the block's colors onto their principal axis (power iteration
+// on the covariance) and returns the two extremes as endpoints.
+std::pair<glm::vec4, glm::vec4> principalEndpoints(const Block &block, int channels)
+{
+    glm::vec4 mean {0.f};
+    for (auto &pixel : block)
+        for (int c = 0; c < channels; c++) mean[c] += pixel[c] / 16.f;
+    glm::mat4 covariance {0.f};
+    for (auto &pixel : block)
+    {
+        glm::vec4 d {0.f};
+        for (int c = 0; c < channels; c++) d[c] = pixel[c] - mean[c];
+        covariance += glm::outerProduct(d, d);
+    }
+    glm::vec4 axis {1.f, 1.f, 1.f, channels == 4 ? 1.f : 0.f};
+    for (int i = 0; i < 8; i++)
+    {
+        axis = covariance * axis;
+        float length = glm::length(axis);
+        if (length < 1e-6f) break;
+        axis /= length;
+    }
+    float low = 0, high = 0;
+    for (auto &pixel : block)
+    {
+        glm::vec4 d {0.f};
+        for (int c = 0; c < channels; c++) d[c] = pixel[c] - mean[c];
+        float t = glm::dot(d, axis);
+        low = std::min(low, t);
+        high = std::max(high, t);
+    }
+    auto clampColor = [](glm::vec4 color) { return glm::clamp(color, glm::vec4(0.f), glm::vec4(255.f)); };
+    return {clampColor(mean + axis * low), clampColor(mean + axis * high)};
+}
+
+int colorDistance(const std::array<int, 4> &a, const std::array<int, 4> &b, int channels)
+{
+    int distance = 0;
+    for (int c = 0; c < channels; c++) distance += (a[c] - b[c]) * (a[c] - b[c]);
+    return distance;
+}
+
+std::uint16_t packRGB565(glm::vec4 color)
+{
+    int r = static_cast<int>(color.r * 31.f / 255.f + 0.5f);
+    int g = static_cast<int>(color.g * 63.f / 255.f + 0.5f);
+    int b = static_cast<int>(color.b * 31.f / 255.f + 0.5f);
+    return static_cast<std::uint16_t>((r << 11) | (g << 5) | b);
+}
+
+std::array<int, 4> unpackRGB565(std::uint16_t color)
+{
+    int r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+    return {(r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2), 255};
+}
+
+// 8 bytes: two 565 endpoints and 2-bit indices, always in four color mode.
+void encodeBC1Block(const Block &block, unsigned char *out)
+{
+    auto endpoints = principalEndpoints(block, 3);
+    std::uint16_t c0 = packRGB565(endpoints.second), c1 = packRGB565(endpoints.first);
+    if (c0 < c1) std::swap(c0, c1);
+    std::uint32_t indices = 0;
+    if (c0 != c1)
+    {
+        std::array<std::array<int, 4>, 4> palette;
+        palette[0] = unpackRGB565(c0);
+        palette[1] = unpackRGB565(c1);
+        for (int c = 0; c < 3; c++)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        for (int i = 0; i < 16; i++)
+        {
+            int best = 0, best_distance = INT_MAX;
+            for (int p = 0; p < 4; p++)
+            {
+                int distance = colorDistance(block[i], palette[p], 3);
+                if (distance < best_distance) { best = p; best_distance = distance; }
+            }
+            indices |= best << (2 * i);
+        }
+    }
+    out[0] = c0 & 0xff; out[1] = c0 >> 8;
+    out[2] = c1 & 0xff; out[3] = c1 >> 8;
+    for (int i = 0; i < 4; i++) out[4 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+// 8 bytes of alpha (two endpoints, 3-bit indices, eight value mode)
+// followed by a BC1 color block.
+void encodeBC3Block(const Block &block, unsigned char *out)
+{
+    int a0 = 0, a1 = 255;
+    for (auto &pixel : block)
+    {
+        a0 = std::max(a0, pixel[3]);
+        a1 = std::min(a1, pixel[3]);
+    }
+    std::uint64_t indices = 0;
+    if (a0 != a1)
+    {
+        std::array<int, 8> palette;
+        palette[0] = a0;
+        palette[1] = a1;
+        for (int i = 2; i < 8; i++) palette[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+        for (int i = 0; i < 16; i++)
+        {
+            std::uint64_t best = 0;
+            int best_distance = INT_MAX;
+            for (int p = 0; p < 8; p++)
+            {
+                int distance = std::abs(block[i][3] - palette[p]);
+                if (distance < best_distance) { best = p; best_distance = distance; }
+            }
+            indices |= best << (3 * i);
+        }
+    }
+    out[0] = static_cast<unsigned char>(a0);
+    out[1] = static_cast<unsigned char>(a1);
+    for (int i = 0; i < 6; i++) out[2 + i] = (indices >> (8 * i)) & 0xff;
+    encodeBC1Block(block, out + 8);
+}
+
+struct BitWriter
+{
+    unsigned char *out;
+    int position = 0;
+
+    void put(std::uint32_t value, int bits)
+    {
+        for (int i = 0; i < bits; i++, position++)
+            if (value & (1u << i)) out[position / 8] |= 1 << (position % 8);
+    }
+};
+
+// 16 bytes in BC7 mode 6: one subset, RGBA endpoints of 7 bits plus a
+// shared low bit each, and 4-bit indices. Tries all four low bit choices.
+void encodeBC7Block(const Block &block, unsigned char *out)
+{
+    static const int weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+    auto endpoints = principalEndpoints(block, 4);
+
+    std::array<std::array<int, 4>, 2> best_endpoints;
+    std::array<int, 2> best_pbits = {0, 0};
+    std::array<int, 16> best_indices;
+    long best_error = LONG_MAX;
+    for (int pbits = 0; pbits < 4; pbits++)
+    {
+        std::array<int, 2> p = {pbits & 1, pbits >> 1};
+        std::array<std::array<int, 4>, 2> quantized;
+        for (int e = 0; e < 2; e++)
+        {
+            glm::vec4 color = e == 0 ? endpoints.first : endpoints.second;
+            for (int c = 0; c < 4; c++)
+                quantized[e][c] = glm::clamp(static_cast<int>((color[c] - p[e]) / 2.f + 0.5f), 0, 127);
+        }
+        std::array<std::array<int, 4>, 16> palette;
+        for (int i = 0; i < 16; i++)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                int e0 = (quantized[0][c] << 1) | p[0], e1 = (quantized[1][c] << 1) | p[1];
+                palette[i][c] = ((64 - weights[i]) * e0 + weights[i] * e1 + 32) >> 6;
+            }
+        }
+        std::array<int, 16> indices;
+        long error = 0;
+        for (int i = 0; i < 16; i++)
+        {
+            int best = 0, best_distance = INT_MAX;
+            for (int w = 0; w < 16; w++)
+            {
+                int distance = colorDistance(block[i], palette[w], 4);
+                if (distance < best_distance) { best = w; best_distance = distance; }
+            }
+            indices[i] = best;
+            error += best_distance;
+        }
+        if (error < best_error)
+        {
+            best_error = error;
+            best_endpoints = quantized;
+            best_pbits = p;
+            best_indices = indices;
+        }
+    }
+    // The first index is stored without its top bit, so it must be below 8.
+    if (best_indices[0] >= 8)
+    {
+        std::swap(best_endpoints[0], best_endpoints[1]);
+        std::swap(best_pbits[0], best_pbits[1]);
+        for (int &index : best_indices) index = 15 - index;
+    }
+
+    std::memset(out, 0, 16);
+    BitWriter writer {out};
+    writer.put(1 << 6, 7);
+    for (int c = 0; c < 4; c++)
+    {
+        writer.put(best_endpoints[0][c], 7);
+        writer.put(best_endpoints[1][c], 7);
+    }
+    writer.put(best_pbits[0], 1);
+    writer.put(best_pbits[1], 1);
+    writer.put(best_indices[0], 3);
+    for (int i = 1; i < 16; i++) writer.put(best_indices[i], 4);
+}
+
+int blockBytes(TextureCodec codec)
+{
+    return codec == TextureCodec::BC1 ? 8 : 16;
+}
+
+// Blocks don't depend on each other, so rows of them are spread over
+// the pool when there is one.
+CompressedLevel compressLevel(
+    const unsigned char *pixels, int channels, int width, int height, TextureCodec codec, ThreadPool *pool = nullptr)
+{
+    int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+    int block_bytes = blockBytes(codec);
+    CompressedLevel level {width, height, std::vector<unsigned char>(blocks_x * blocks_y * block_bytes)};
+    auto compressRows = [&](size_t first_row, size_t end_row)
+    {
+        for (int by = static_cast<int>(first_row); by < static_cast<int>(end_row); by++)
+        {
+            for (int bx = 0; bx < blocks_x; bx++)
+            {
+                Block block = loadBlock(pixels, channels, width, height, bx, by);
+                unsigned char *out = &level.blocks[(by * blocks_x + bx) * block_bytes];
+                if (codec == TextureCodec::BC1) encodeBC1Block(block, out);
+                else if (codec == TextureCodec::BC3) encodeBC3Block(block, out);
+                else encodeBC7Block(block, out);
+            }
+        }
+    };
+    if (pool) parallelFor(*pool, 0, blocks_y, 4, compressRows, "compress blocks");
+    else compressRows(0, blocks_y);
+    return level;
+}
+
+// Codecs for this image, best first: BC7, else BC3 if the source has
+// alpha and BC1 if it doesn't, since BC3 spends half its bits on alpha.
+std::vector<TextureCodec> codecCandidates(const Image &image)
+{
+    return {TextureCodec::BC7, hasAlpha(image.channels) ? TextureCodec::BC3 : TextureCodec::BC1};
+}
+
+// The best codec the driver takes for this image. Returns false when
+// none is supported.
+bool pickCodec(const Image &image, TextureCodec &codec)
+{
+    for (TextureCodec candidate : codecCandidates(image))
+    {
+        if (!isCodecSupported(candidate)) continue;
+        codec = candidate;
+        return true;
+    }
+    return false;
+}
+
+CompressedImage compressImage(const Image &image, const MipChain &mips, TextureCodec codec, ThreadPool *pool = nullptr)
+{
+    CompressedImage compressed;
+    compressed.codec = codec;
+    compressed.levels.push_back(compressLevel(image.data, image.channels, image.width, image.height, codec, pool));
+    for (const MipLevel &mip : mips.levels)
+        compressed.levels.push_back(compressLevel(mip.pixels.data(), mips.channels, mip.width, mip.height, codec, pool));
+    return compressed;
+}
+
+constexpr std::uint32_t COMPRESSED_IMAGE_MAGIC = 0x31594d43; // "CMY1"
+
+bool loadCompressedImage(const std::string &path, CompressedImage &image)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::uint32_t magic = 0, codec = 0, num_levels = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    file.read(reinterpret_cast<char*>(&codec), sizeof(codec));
+    file.read(reinterpret_cast<char*>(&num_levels), sizeof(num_levels));
+    if (!file || magic != COMPRESSED_IMAGE_MAGIC) return false;
+    image.codec = static_cast<TextureCodec>(codec);
+    image.levels.resize(num_levels);
+    for (CompressedLevel &level : image.levels)
+    {
+        file.read(reinterpret_cast<char*>(&level.width), sizeof(level.width));
+        file.read(reinterpret_cast<char*>(&level.height), sizeof(level.height));
+        if (!file || level.width <= 0 || level.height <= 0) return false;
+        level.blocks.resize(((level.width + 3) / 4) * ((level.height + 3) / 4) * blockBytes(image.codec));
+        file.read(reinterpret_cast<char*>(level.blocks.data()), level.blocks.size());
+    }
+    return static_cast<bool>(file);
+}
+
+void saveCompressedImage(const std::string &path, const CompressedImage &image)
+{
+    std::error_code error;
+    std::filesystem::create_directories(COMPRESSED_CACHE_DIR, error);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return;
+    std::uint32_t codec = static_cast<std::uint32_t>(image.codec);
+    std::uint32_t num_levels = static_cast<std::uint32_t>(image.levels.size());
+    file.write(reinterpret_cast<const char*>(&COMPRESSED_IMAGE_MAGIC), sizeof(COMPRESSED_IMAGE_MAGIC));
+    file.write(reinterpret_cast<const char*>(&codec), sizeof(codec));
+    file.write(reinterpret_cast<const char*>(&num_levels), sizeof(num_levels));
+    for (const CompressedLevel &level : image.levels)
+    {
+        file.write(reinterpret_cast<const char*>(&level.width), sizeof(level.width));
+        file.write(reinterpret_cast<const char*>(&level.height), sizeof(level.height));
+        file.write(reinterpret_cast<const char*>(level.blocks.data()), level.blocks.size());
+    }
+}
+
+// Encodes once per source file, codec and mip filter; later runs read
+// the blocks back from COMPRESSED_CACHE_DIR.
+std::string compressedCachePath(const Image &image, TextureCodec codec, MipFilter mip_filter)
+{
+    std::string key = sourceFileKey(image);
+    if (key.empty()) return "";
+    key += std::to_string(static_cast<int>(codec)) + '\0' + std::to_string(static_cast<int>(mip_filter));
+    std::stringstream path;
+    path << COMPRESSED_CACHE_DIR << std::hex << hashBytes(key) << ".bc";
+    return path.str();
+}
+
+CompressedImage importCompressedImage(const Image &image, TextureCodec codec, MipFilter mip_filter, ThreadPool *pool = nullptr)
+{
+    std::string cache_path = compressedCachePath(image, codec, mip_filter);
+    CompressedImage compressed;
+    if (!cache_path.empty() && loadCompressedImage(cache_path, compressed)) return compressed;
+    compressed = compressImage(image, importMipChain(image, mip_filter), codec, pool);
+    if (!cache_path.empty()) saveCompressedImage(cache_path, compressed);
+    return compressed;
+}
+
+struct SkylineSegment
+{
+    int x, y, width;
+};
+
+// Bottom-left skyline packing: each rectangle goes where its top edge
+// ends up lowest. Returns false when it doesn't fit.
+bool placeOnSkyline(std::vector<SkylineSegment> &skyline, int atlas_width, int atlas_height, int width, int height, AtlasRect &placed)
+{
+    int best_segment = -1, best_top = INT_MAX, best_waste = INT_MAX;
+    for (int i = 0; i < static_cast<int>(skyline.size()); i++)
+    {
+        int x = skyline[i].x;
+        if (x + width > atlas_width) break;
+        // The rectangle rests on the highest segment it spans.
+        int y = 0, waste = 0, spanned = 0;
+        for (int j = i; spanned < width; j++)
+        {
+            y = std::max(y, skyline[j].y);
+            spanned += skyline[j].width;
+        }
+        spanned = 0;
+        for (int j = i; spanned < width; j++)
+        {
+            int covered = std::min(skyline[j].width, width - spanned);
+            waste += covered * (y - skyline[j].y);
+            spanned += skyline[j].width;
+        }
+        if (y + height > atlas_height) continue;
+        if (y + height < best_top || (y + height == best_top && waste < best_waste))
+        {
+            best_segment = i;
+            best_top = y + height;
+            best_waste = waste;
+        }
+    }
+    if (best_segment < 0) return false;
+
+    placed = {skyline[best_segment].x, best_top - height, width, height};
+    SkylineSegment raised {placed.x, best_top, width};
+    // Cut away whatever the new segment now covers.
+    int end = placed.x + width;
+    auto it = skyline.begin() + best_segment;
+    while (it != skyline.end() && it->x < end)
+    {
+        int segment_end = it->x + it->width;
+        if (segment_end <= end)
+        {
+            it = skyline.erase(it);
+            continue;
+        }
+        it->width = segment_end - end;
+        it->x = end;
+        break;
+    }
+    skyline.insert(it, raised);
+    // Merge neighbours at the same height.
+    for (size_t i = 1; i < skyline.size();)
+    {
+        if (skyline[i - 1].y == skyline[i].y)
+        {
+            skyline[i - 1].width += skyline[i].width;
+            skyline.erase(skyline.begin() + i);
+        }
+        else i++;
+    }
+    return true;
+}
+
+// Packs the images into the smallest power-of-two page up to max_size.
+// Every image gets a gutter of wrapped pixels, and each padded cell
+// starts and ends on a multiple of alignment. With alignment 2^n and
+// MipFilter::BOX, mip levels up to n never blend neighbouring images;
+// KAISER's wider kernel reaches past the cell, so mip pages with BOX.
+Result<TextureAtlas> buildAtlas(const std::vector<const Image*> &images, int max_size, int gutter, int alignment)
+{
+    auto alignUp = [&](int value) { return (value + alignment - 1) / alignment * alignment; };
+    std::vector<int> order(images.size());
+    long total_area = 0;
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        order[i] = static_cast<int>(i);
+        total_area += static_cast<long>(alignUp(images[i]->width + 2*gutter)) * alignUp(images[i]->height + 2*gutter);
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [&](int a, int b) { return images[a]->height > images[b]->height; });
+
+    int size = alignment;
+    while (static_cast<long>(size) * size < total_area) size *= 2;
+    for (; size <= max_size; size *= 2)
+    {
+        TextureAtlas atlas;
+        atlas.width = atlas.height = size;
+        atlas.placements.resize(images.size());
+        std::vector<SkylineSegment> skyline = {{0, 0, size}};
+        bool fits = true;
+        for (int i : order)
+        {
+            AtlasRect cell;
+            int cell_width = alignUp(images[i]->width + 2*gutter);
+            int cell_height = alignUp(images[i]->height + 2*gutter);
+            if (!placeOnSkyline(skyline, size, size, cell_width, cell_height, cell)) { fits = false; break; }
+            atlas.placements[i] = {cell.x + gutter, cell.y + gutter, images[i]->width, images[i]->height};
+        }
+        if (!fits) continue;
+
+        atlas.pixels.assign(4 * size * size, 0);
+        for (size_t i = 0; i < images.size(); i++)
+        {
+            const Image &image = *images[i];
+            const AtlasRect &rect = atlas.placements[i];
+            // Gutter pixels wrap around, matching GL_REPEAT at the edges.
+            for (int y = -gutter; y < rect.height + gutter; y++)
+            {
+                int sy = ((y % image.height) + image.height) % image.height;
+                for (int x = -gutter; x < rect.width + gutter; x++)
+                {
+                    int sx = ((x % image.width) + image.width) % image.width;
+                    auto rgba = rgbaAt(image.data, sy * image.width + sx, image.channels);
+                    std::memcpy(&atlas.pixels[4 * ((rect.y + y) * size + rect.x + x)], rgba.data(), 4);
+                }
+            }
+        }
+        return successfulResult(std::move(atlas));
+    }
+    return errorResult<TextureAtlas>("Images don't fit in a " + std::to_string(max_size) + " atlas");
+}
+
+// Moves the mesh's texcoords into the image's spot in the atlas. Texcoords
+// outside [0, 1] relied on GL_REPEAT, which an atlas can't give them.
+Result<bool> remapTexcoords(MeshData &mesh_data, const TextureAtlas &atlas, int image_index)
+{
+    if (!(mesh_data.layout & MeshLayout::TEX))
+        return errorResult<bool>("Mesh has no texture coordinates");
+    int stride = vertexStride(mesh_data) / sizeof(GLfloat);
+    auto &vertices = mesh_data.vertices;
+    for (size_t i = 0; i < vertices.size(); i += stride)
+    {
+        float s = vertices[i + 3], t = vertices[i + 4];
+        if (s < 0.f || s > 1.f || t < 0.f || t > 1.f)
+            return errorResult<bool>("Texture coordinates repeat; can't be atlased");
+    }
+    const AtlasRect &rect = atlas.placements[image_index];
+    for (size_t i = 0; i < vertices.size(); i += stride)
+    {
+        vertices[i + 3] = (rect.x + vertices[i + 3] * rect.width) / atlas.width;
+        vertices[i + 4] = (rect.y + vertices[i + 4] * rect.height) / atlas.height;
+    }
+    return successfulResult(true);
+}
+
+// Looks the key up and marks it most recently used.
+CachedResource *findResource(ResourceCache &cache, const std::string &key)
+{
+    auto entry = cache.entries.find(key);
+    if (entry == cache.entries.end())
+    {
+        cache.counters.misses++;
+        return nullptr;
+    }
+    cache.counters.hits++;
+    cache.lru.splice(cache.lru.begin(), cache.lru, entry->second.lru_position);
+    return &entry->second;
+}
+
+// Entries still referenced outside the cache stay, even over budget.
+void enforceBudget(ResourceCache &cache)
+{
+    auto it = cache.lru.end();
+    while (it != cache.lru.begin() && (cache.cpu_used > cache.cpu_budget || cache.gpu_used > cache.gpu_budget))
+    {
+        --it;
+        CachedResource &entry = cache.entries[*it];
+        bool referenced =
+            (entry.image && entry.image.use_count() > 1) ||
+            (entry.texture && entry.texture.use_count() > 1);
+        if (referenced) continue;
+        cache.cpu_used -= entry.cpu_bytes;
+        cache.gpu_used -= entry.gpu_bytes;
+        cache.entries.erase(*it);
+        it = cache.lru.erase(it);
+        cache.counters.evictions++;
+    }
+}
+
+CachedResource &insertResource(ResourceCache &cache, const std::string &key, CachedResource resource)
+{
+    cache.lru.push_front(key);
+    resource.lru_position = cache.lru.begin();
+    cache.cpu_used += resource.cpu_bytes;
+    cache.gpu_used += resource.gpu_bytes;
+    CachedResource &entry = cache.entries[key] = std::move(resource);
+    return entry;
+}
+
+std::shared_ptr<Image> decodeImage(const std::string &filename)
+{
+    return std::shared_ptr<Image>(new Image(filename.c_str()), [](Image *image)
+    {
+        freePixels(*image);
+        delete image;
+    });
+}
+
+Result<std::shared_ptr<const Image>> getImage(ResourceCache &cache, const std::string &filename)
+{
+    std::string key = "image:" + filename;
+    if (CachedResource *entry = findResource(cache, key))
+        return successfulResult<std::shared_ptr<const Image>>(entry->image);
+    std::shared_ptr<Image> image = decodeImage(filename);
+    if (!image->data)
+        return errorResult<std::shared_ptr<const Image>>("Could not decode " + image->path);
+    CachedResource resource;
+    resource.image = image;
+    resource.cpu_bytes = imageDataSize(*image);
+    std::shared_ptr<const Image> result = insertResource(cache, key, std::move(resource)).image;
+    enforceBudget(cache);
+    return successfulResult(result);
+}
+
+// The pixels are only kept if the image is cached on its own through
+// getImage; otherwise they're freed as soon as the texture is made.
+std::string textureKey(const std::string &filename, TextureOptions options)
+{
+    return "texture:" + filename
+        + '|' + std::to_string(static_cast<int>(options.mip_filter))
+        + '|' + std::to_string(options.compress);
+}
+
+// Forgets an entry so the next request loads it again. Whoever still
+// holds the old resource keeps it until they let go.
+void dropResource(ResourceCache &cache, const std::string &key)
+{
+    auto entry = cache.entries.find(key);
+    if (entry == cache.entries.end()) return;
+    cache.cpu_used -= entry->second.cpu_bytes;
+    cache.gpu_used -= entry->second.gpu_bytes;
+    cache.lru.erase(entry->second.lru_position);
+    cache.entries.erase(entry);
+}
+
+PreparedTexture prepareTexture(const Image &image, TextureOptions options, ThreadPool *pool = nullptr)
+{
+    PreparedTexture prepared;
+    TextureCodec codec;
+    prepared.compressed = options.compress && pickCodec(image, codec);
+    if (prepared.compressed) prepared.blocks = importCompressedImage(image, codec, options.mip_filter, pool);
+    else prepared.mips = importMipChain(image, options.mip_filter);
+    return prepared;
+}
+
+CachedResource textureResource(const Image &image, const PreparedTexture &prepared)
+{
+    CachedResource resource;
+    if (prepared.compressed)
+    {
+        for (const CompressedLevel &level : prepared.blocks.levels) resource.gpu_bytes += level.blocks.size();
+        resource.texture = std::make_shared<Texture>(prepared.blocks);
+    }
+    else
+    {
+        resource.gpu_bytes = imageDataSize(image);
+        for (const MipLevel &level : prepared.mips.levels) resource.gpu_bytes += level.pixels.size();
+        resource.texture = std::make_shared<Texture>(image, &prepared.mips);
+    }
+    return resource;
+}
+
+// With prepared, which has to come from decoded, only the GL work is left.
+Result<std::shared_ptr<const Texture>> getTexture(
+    ResourceCache &cache, const std::string &filename, TextureOptions options,
+    std::shared_ptr<const Image> decoded = nullptr, const PreparedTexture *prepared = nullptr)
+{
+    std::string key = textureKey(filename, options);
+    if (CachedResource *entry = findResource(cache, key))
+        return successfulResult<std::shared_ptr<const Texture>>(entry->texture);
+
+    std::shared_ptr<const Image> image = decoded;
+    if (!image)
+    {
+        auto cached_image = cache.entries.find("image:" + filename);
+        if (cached_image != cache.entries.end()) image = cached_image->second.image;
+        else image = decodeImage(filename);
+    }
+    if (!image->data)
+        return errorResult<std::shared_ptr<const Texture>>("Could not decode " + image->path);
+
+    PreparedTexture prepared_here;
+    if (!prepared)
+    {
+        prepared_here = prepareTexture(*image, options);
+        prepared = &prepared_here;
+    }
+    CachedResource resource = textureResource(*image, *prepared);
+    image.reset();
+    std::shared_ptr<const Texture> result = insertResource(cache, key, std::move(resource)).texture;
+    enforceBudget(cache);
+    return successfulResult(result);
+}
+
+// Builds the texture from new pixels before swapping it in for the cached
+// one, so a reload that fails leaves the old entry, and its accounting,
+// as they were.
+Result<std::shared_ptr<const Texture>> reloadTexture(
+    ResourceCache &cache, const std::string &filename, TextureOptions options,
+    std::shared_ptr<const Image> decoded, const PreparedTexture &prepared)
+{
+    if (!decoded->data)
+        return errorResult<std::shared_ptr<const Texture>>("Could not decode " + decoded->path);
+    CachedResource resource = textureResource(*decoded, prepared);
+    std::string key = textureKey(filename, options);
+    dropResource(cache, key);
+    std::shared_ptr<const Texture> result = insertResource(cache, key, std::move(resource)).texture;
+    enforceBudget(cache);
+    return successfulResult(result);
+}
+
+void pushGLJob(GLJobQueue &queue, std::function<void()> job)
+{
+    GLJobQueue::Node *node = new GLJobQueue::Node;
+    node->job = std::move(job);
+    GLJobQueue::Node *previous = queue.head.exchange(node, std::memory_order_acq_rel);
+    previous->next.store(node, std::memory_order_release);
+}
+
+// GL thread only. False when the queue is empty, or when a push is
+// halfway done; that job is picked up on a later call.
+bool popGLJob(GLJobQueue &queue, std::function<void()> &job)
+{
+    GLJobQueue::Node *tail = queue.tail;
+    GLJobQueue::Node *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &queue.stub)
+    {
+        if (!next) return false;
+        queue.tail = tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (!next)
+    {
+        if (tail != queue.head.load(std::memory_order_acquire)) return false;
+        // tail is the last node; put the stub behind it so it can be taken.
+        queue.stub.next.store(nullptr, std::memory_order_relaxed);
+        GLJobQueue::Node *previous = queue.head.exchange(&queue.stub, std::memory_order_acq_rel);
+        previous->next.store(&queue.stub, std::memory_order_release);
+        next = tail->next.load(std::memory_order_acquire);
+        if (!next) return false;
+    }
+    queue.tail = next;
+    job = std::move(tail->job);
+    delete tail;
+    return true;
+}
+
+GLJobQueue::~GLJobQueue()
+{
+    std::function<void()> job;
+    while (popGLJob(*this, job)) {}
+}
+
+// Call once per frame on the GL thread. Finishes queued loads until the
+// frame budget is spent, always at least one so loading can't stall.
+void pumpLoads(BackgroundLoader &loader)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::function<void()> job;
+    while (popGLJob(loader.gl_jobs, job))
+    {
+        job();
+        std::chrono::duration<double, std::milli> spent = std::chrono::steady_clock::now() - start;
+        if (spent.count() >= loader.frame_budget_ms) break;
+    }
+}
+
+// Blocks until every load started so far has finished.
+void finishLoads(BackgroundLoader &loader)
+{
+    std::function<void()> job;
+    while (loader.outstanding > 0)
+    {
+        if (popGLJob(loader.gl_jobs, job)) job();
+        else std::this_thread::yield();
+    }
+}
+
+// co_await onPool(pool) carries on as a job on one of the pool's workers.
+auto onPool(ThreadPool &pool)
+{
+    struct PoolAwaiter
+    {
+        ThreadPool &pool;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            spawn(pool, [handle] { handle.resume(); }, nullptr, "coroutine");
+        }
+        void await_resume() {}
+    };
+    return PoolAwaiter {pool};
+}
+
+// co_await onGLThread(loader) carries on inside the GL thread's pumpLoads.
+auto onGLThread(BackgroundLoader &loader)
+{
+    struct GLAwaiter
+    {
+        BackgroundLoader &loader;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            auto pending = std::make_shared<PendingResume>(handle);
+            pushGLJob(loader.gl_jobs, [pending] { std::exchange(pending->handle, nullptr).resume(); });
+        }
+        void await_resume() {}
+    };
+    return GLAwaiter {loader};
+}
+
+struct JoinState
+{
+    std::atomic<int> remaining {0};
+    std::coroutine_handle<> waiting;
+};
+
+template <typename T>
+Detached runJoined(Task<T> task, T *result, std::shared_ptr<JoinState> state)
+{
+    *result = co_await task;
+    if (--state->remaining == 0) state->waiting.resume();
+}
+
+// Suspends until the children start() launches with runJoined are done.
+template <typename Start>
+auto joinChildren(std::shared_ptr<JoinState> state, int children, Start start)
+{
+    struct JoinAwaiter
+    {
+        std::shared_ptr<JoinState> state;
+        int children;
+        Start start;
+
+        bool await_ready() { return children == 0; }
+        bool await_suspend(std::coroutine_handle<> waiting)
+        {
+            state->waiting = waiting;
+            // One extra for this call, so children that finish before
+            // start returns can't resume the waiter under it.
+            state->remaining = children + 1;
+            start();
+            return --state->remaining > 0;
+        }
+        void await_resume() {}
+    };
+    return JoinAwaiter {state, children, start};
+}
+
+// Runs the tasks side by side; each takes itself onto the pool.
+template <typename T>
+Task<std::vector<T>> whenAll(std::vector<Task<T>> tasks)
+{
+    std::vector<T> results(tasks.size());
+    auto state = std::make_shared<JoinState>();
+    co_await joinChildren(state, (int)tasks.size(), [&]
+    {
+        for (size_t i = 0; i < tasks.size(); i++)
+            runJoined(std::move(tasks[i]), &results[i], state);
+    });
+    co_return results;
+}
+
+template <typename A, typename B>
+Task<std::pair<A, B>> whenAll(Task<A> first, Task<B> second)
+{
+    std::pair<A, B> results;
+    auto state = std::make_shared<JoinState>();
+    co_await joinChildren(state, 2, [&]
+    {
+        runJoined(std::move(first), &results.first, state);
+        runJoined(std::move(second), &results.second, state);
+    });
+    co_return results;
+}
+
+template <typename T, typename Finish>
+Detached finishOnGLThread(BackgroundLoader &loader, Task<T> task, Finish finish)
+{
+    // Counts the load as done however the coroutine ends, so a finish
+    // that throws or a frame dropped at shutdown can't hang finishLoads.
+    struct OutstandingGuard
+    {
+        std::atomic<int> &outstanding;
+        ~OutstandingGuard() { outstanding--; }
+    } guard {loader.outstanding};
+    T loaded = co_await task;
+    co_await onGLThread(loader);
+    finish(loaded);
+}
+
+// Runs task, which takes itself onto the pool, then finish(result) on the
+// GL thread. Only finish may touch GL or anything the GL thread owns.
+template <typename T, typename Finish>
+void loadInBackground(BackgroundLoader &loader, Task<T> task, Finish finish)
+{
+    loader.outstanding++;
+    finishOnGLThread(loader, std::move(task), std::move(finish));
+}
+
+// Reads from the pack or a loose file on the pool, failing where
+// loadFile would quietly give back nothing.
+Task<Result<std::string>> readFileAsync(ThreadPool &pool, std::string path)
+{
+    co_await onPool(pool);
+    if (!findAsset(path) && !std::filesystem::exists(path))
+        co_return errorResult<std::string>("Could not open " + path);
+    co_return successfulResult(loadFile(path));
+}
+
+Task<Result<MeshData>> parseMeshAsync(ThreadPool &pool, std::string path, std::string obj_text, MeshPrimitiveType mode)
+{
+    co_await onPool(pool);
+    co_return importOBJ(path, obj_text, mode);
+}
+
+Task<Result<MeshData>> loadMeshAsync(ThreadPool &pool, std::string path, MeshPrimitiveType mode = MeshPrimitiveType::TRIANGLES)
+{
+    auto textResult = co_await readFileAsync(pool, path);
+    if (!textResult.success) co_return errorResult<MeshData>(textResult.error);
+    co_return co_await parseMeshAsync(pool, path, std::move(textResult.obj), mode);
+}
+
+Task<Result<std::shared_ptr<Image>>> loadImageAsync(ThreadPool &pool, std::string filename)
+{
+    co_await onPool(pool);
+    std::shared_ptr<Image> image = decodeImage(filename);
+    if (!image->data) co_return errorResult<std::shared_ptr<Image>>("Could not decode " + image->path);
+    co_return successfulResult(image);
+}
+
+// Decodes and then compresses or mips the image, ready for getTexture.
+Task<Result<TextureAsset>> loadTextureAsync(ThreadPool &pool, std::string filename, TextureOptions options)
+{
+    auto imageResult = co_await loadImageAsync(pool, filename);
+    if (!imageResult.success) co_return errorResult<TextureAsset>(imageResult.error);
+    TextureAsset texture;
+    texture.name = filename;
+    texture.image = imageResult.obj;
+    texture.prepared = prepareTexture(*texture.image, options, &pool);
+    co_return successfulResult(std::move(texture));
+}
+
+// The whitespace-separated arguments on each line that starts with
+// keyword, like the mtllib lines of an OBJ.
+std::vector<std::vector<std::string>> keywordArguments(const std::string &text, const std::string &keyword)
+{
+    std::vector<std::vector<std::string>> arguments;
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        std::istringstream tokens(line);
+        std::string found;
+        if (!(tokens >> found) || found != keyword) continue;
+        std::vector<std::string> line_arguments;
+        for (std::string token; tokens >> token;) line_arguments.push_back(token);
+        if (!line_arguments.empty()) arguments.push_back(std::move(line_arguments));
+    }
+    return arguments;
+}
+
+// The first map_Kd across the OBJ's material libraries, or
+// default_texture when none names one. A map_Kd line may carry options
+// like -s or -bm before the file, so the file is its last argument.
+// Images all live in IMAGE_DIR, so only the file name of the map is kept.
+Task<Result<TextureAsset>> loadMaterialTextureAsync(
+    ThreadPool &pool, std::string obj_path, std::string obj_text,
+    TextureOptions options, std::string default_texture)
+{
+    std::string texture = default_texture;
+    std::filesystem::path model_dir = std::filesystem::path(obj_path).parent_path();
+    std::vector<std::string> libraries;
+    for (auto &line : keywordArguments(obj_text, "mtllib"))
+        libraries.insert(libraries.end(), line.begin(), line.end());
+    for (const std::string &library : libraries)
+    {
+        auto mtlResult = co_await readFileAsync(pool, (model_dir / library).generic_string());
+        if (!mtlResult.success) continue;
+        auto maps = keywordArguments(mtlResult.obj, "map_Kd");
+        if (maps.empty()) continue;
+        texture = std::filesystem::path(maps.front().back()).filename().string();
+        break;
+    }
+    co_return co_await loadTextureAsync(pool, texture, options);
+}
+
+// OBJ, then its MTL, then the texture that names, with the mesh parsing
+// alongside the material chain. A texture that fails only costs the
+// model its texture: the mesh comes back with an empty TextureAsset.
+Task<Result<ModelAsset>> loadModelAsync(
+    ThreadPool &pool, std::string path, TextureOptions options, std::string default_texture)
+{
+    auto textResult = co_await readFileAsync(pool, path);
+    if (!textResult.success) co_return errorResult<ModelAsset>(textResult.error);
+    auto [meshResult, textureResult] = co_await whenAll(
+        parseMeshAsync(pool, path, textResult.obj, MeshPrimitiveType::TRIANGLES),
+        loadMaterialTextureAsync(pool, path, textResult.obj, options, default_texture));
+    if (!meshResult.success) co_return errorResult<ModelAsset>(meshResult.error);
+    ModelAsset model;
+    model.mesh = std::move(meshResult.obj);
+    if (textureResult.success) model.texture = std::move(textureResult.obj);
+    else std::cerr << textureResult.error << ", drawing " << path << " untextured\n";
+    co_return successfulResult(std::move(model));
+}
+
+// Returns the counts since the last call and starts new ones.
+ResourceCounters takeResourceCounters(ResourceCache &cache)
+{
+    ResourceCounters counters = cache.counters;
+    cache.counters = ResourceCounters();
+    return counters;
+}
+
+// assetc: builds everything the game would otherwise convert on first
+// load, keyed the same way, so a fresh checkout starts as fast as a warm
+// one. Program binaries are left to the first run, since only the driver
+// that will load them can produce them.
+constexpr MipFilter ASSETC_MIP_FILTER = MipFilter::BOX;
+
+enum class CompileOutcome { BUILT, UP_TO_DATE, FAILED };
+
+struct CompileResult
+{
+    CompileOutcome outcome;
+    std::string error;
+};
+
+bool isImageAsset(const std::filesystem::path &path)
+{
+    std::string extension = path.extension().string();
+    for (const char *image : {".png", ".gif", ".jpg", ".jpeg", ".bmp", ".tga"})
+        if (extension == image) return true;
+    return false;
+}
+
+// Whoever loads an OBJ picks its primitive type, so both are built.
+CompileResult compileMesh(const std::string &path)
+{
+    std::string obj_text = loadFile(path);
+    CompileResult result {CompileOutcome::UP_TO_DATE, ""};
+    for (MeshPrimitiveType mode : {MeshPrimitiveType::TRIANGLES, MeshPrimitiveType::LINE_SEGMENTS})
+    {
+        if (std::filesystem::exists(meshCachePath(path, obj_text, mode))) continue;
+        auto importResult = importOBJ(path, obj_text, mode);
+        if (!importResult.success) return {CompileOutcome::FAILED, path + ": " + importResult.error};
+        result.outcome = CompileOutcome::BUILT;
+    }
+    return result;
+}
+
+CompileResult compileTexture(ThreadPool &pool, const std::string &path)
+{
+    auto mappedResult = mapFile(path);
+    if (!mappedResult.success) return {CompileOutcome::FAILED, mappedResult.error};
+    Image image(path, mappedResult.obj.data, mappedResult.obj.size);
+    if (!image.data) return {CompileOutcome::FAILED, "Could not decode " + path};
+    CompileResult result {CompileOutcome::UP_TO_DATE, ""};
+    if (!std::filesystem::exists(mipCachePath(image, ASSETC_MIP_FILTER)))
+    {
+        importMipChain(image, ASSETC_MIP_FILTER);
+        result.outcome = CompileOutcome::BUILT;
+    }
+    // No GL context here to ask pickCodec, so every codec it could
+    // settle on gets built.
+    for (TextureCodec codec : codecCandidates(image))
+    {
+        if (std::filesystem::exists(compressedCachePath(image, codec, ASSETC_MIP_FILTER))) continue;
+        importCompressedImage(image, codec, ASSETC_MIP_FILTER, &pool);
+        result.outcome = CompileOutcome::BUILT;
+    }
+    freePixels(image);
+    return result;
+}
+
+// Compiles every mesh and image under source_dir, independent assets in
+// parallel on the pool. Assets whose outputs already exist for their
+// current contents are skipped.
+Result<bool> compileAssets(ThreadPool &pool, const std::string &source_dir)
+{
+    std::vector<std::future<CompileResult>> jobs;
+    std::error_code error;
+    for (auto it = std::filesystem::recursive_directory_iterator(source_dir, error);
+         !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+    {
+        if (!it->is_regular_file()) continue;
+        std::string path = packPath(it->path().string());
+        if (it->path().extension() == ".obj")
+            jobs.push_back(runAsync(pool, [path] { return compileMesh(path); }, "compile mesh"));
+        else if (isImageAsset(it->path()))
+            jobs.push_back(runAsync(pool, [&pool, path] { return compileTexture(pool, path); }, "compile texture"));
+    }
+    if (error) return errorResult<bool>("Could not list " + source_dir + ": " + error.message());
+
+    int built = 0, up_to_date = 0, failed = 0;
+    for (auto &job : jobs)
+    {
+        CompileResult result = job.get();
+        if (result.outcome == CompileOutcome::BUILT) built++;
+        else if (result.outcome == CompileOutcome::UP_TO_DATE) up_to_date++;
+        else
+        {
+            failed++;
+            std::cerr << result.error << "\n";
+        }
+    }
+    std::cout << "assetc: " << built << " built, " << up_to_date << " up to date, " << failed << " failed\n";
+    if (failed) return errorResult<bool>(std::to_string(failed) + " assets failed to compile");
+    return successfulResult(true);
+}
+
+// Draws a field of small, distant quads so the texture is heavily
+// minified, and returns the average GPU time per frame in milliseconds.
+// draw_field gets the quads' model matrices and draws them all, as one
+// instanced draw or one DrawBatcher flush.
+double timeMinifiedSampling(
+    const std::function<void(const glm::mat4 *models, GLsizei count)> &draw_field, int frames)
+{
+    std::vector<glm::mat4> models;
+    for (int row = 0; row < 64; row++)
+    {
+        for (int column = 0; column < 64; column++)
+        {
+            glm::vec3 position {column * 0.5f - 16.f, -2.f, -10.f - row * 0.5f};
+            glm::mat4 model = glm::translate(glm::mat4(1.f), position);
+            model = glm::rotate(model, -glm::half_pi<float>(), glm::vec3(1.f, 0.f, 0.f));
+            models.push_back(glm::scale(model, glm::vec3(0.25f)));
+        }
+    }
+    GLuint query;
+    glGenQueries(1, &query);
+    double total_ms = 0;
+    for (int frame = 0; frame < frames; frame++)
+    {
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        draw_field(models.data(), static_cast<GLsizei>(models.size()));
+        glEndQuery(GL_TIME_ELAPSED);
+        GLuint64 elapsed_ns = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_ns);
+        total_ms += elapsed_ns / 1e6;
+    }
+    glDeleteQueries(1, &query);
+    return total_ms / frames;
+}
+
+constexpr GLsizeiptr UPLOAD_ALIGNMENT = 16;
+
+void uploadWorker(TextureUploader *uploader)
+{
+    std::unique_lock<std::mutex> lock(uploader->mutex);
+    while (true)
+    {
+        uploader->wake_worker.wait(lock, [&] { return uploader->stopping || !uploader->to_copy.empty(); });
+        if (uploader->stopping) return;
+        PixelUpload upload = uploader->to_copy.front();
+        uploader->to_copy.pop_front();
+        lock.unlock();
+        std::memcpy(uploader->mapped + upload.offset, upload.image->data, upload.size);
+        upload.image.reset();
+        lock.lock();
+        uploader->copied.push_back(upload);
+    }
+}
+
+Result<bool> startTextureUploader(TextureUploader &uploader, GLsizeiptr capacity)
+{
+    if (!GLEW_VERSION_4_4 && !GLEW_ARB_buffer_storage)
+        return errorResult<bool>("Persistent mapping needs ARB_buffer_storage");
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &uploader.buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploader.buffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, capacity, nullptr, flags);
+    uploader.mapped = static_cast<unsigned char*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, capacity, flags));
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!uploader.mapped)
+        return errorResult<bool>("Could not map the pixel unpack buffer");
+    uploader.capacity = capacity;
+    uploader.worker = std::thread(uploadWorker, &uploader);
+    return successfulResult(true);
+}
+
+// Uploads only ever retire in the order they were reserved,
+// so the ring just needs a head and a count of used bytes.
+GLsizeiptr reserveUpload(TextureUploader &uploader, GLsizeiptr size, GLsizeiptr &reserved)
+{
+    size = (size + UPLOAD_ALIGNMENT - 1) / UPLOAD_ALIGNMENT * UPLOAD_ALIGNMENT;
+    GLsizeiptr skipped = uploader.head + size > uploader.capacity ? uploader.capacity - uploader.head : 0;
+    if (uploader.used + skipped + size > uploader.capacity) return -1;
+    GLsizeiptr offset = skipped ? 0 : uploader.head;
+    reserved = skipped + size;
+    uploader.used += reserved;
+    uploader.head = offset + size;
+    return offset;
+}
+
+// The texture exists right away, with undefined contents until its
+// pixels arrive through pumpUploads. Falls back to a blocking upload
+// when the image doesn't fit in the ring at the moment. The uploader
+// keeps its own reference to image until the pixels are copied.
+Texture startUpload(TextureUploader &uploader, std::shared_ptr<const Image> image_ptr)
+{
+    const Image &image = *image_ptr;
+    Image placeholder = image;
+    placeholder.data = nullptr;
+    Texture texture {placeholder};
+
+    PixelUpload upload;
+    upload.size = imageDataSize(image);
+    upload.offset = uploader.buffer ? reserveUpload(uploader, upload.size, upload.reserved) : -1;
+    if (upload.offset < 0)
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image.width, image.height, textureFormat(image), GL_UNSIGNED_BYTE, image.data);
+        return texture;
+    }
+    texture.upload_wanted = std::make_shared<bool>(true);
+    upload.texture = texture.id;
+    upload.wanted = texture.upload_wanted;
+    upload.format = textureFormat(image);
+    upload.width = image.width;
+    upload.height = image.height;
+    upload.image = std::move(image_ptr);
+    {
+        std::lock_guard<std::mutex> lock(uploader.mutex);
+        uploader.to_copy.push_back(upload);
+    }
+    uploader.wake_worker.notify_one();
+    uploader.pending++;
+    return texture;
+}
+
+// Call once per frame on the GL thread. Never waits on the GPU or the worker.
+void pumpUploads(TextureUploader &uploader)
+{
+    std::deque<PixelUpload> copied;
+    {
+        std::lock_guard<std::mutex> lock(uploader.mutex);
+        copied.swap(uploader.copied);
+    }
+    if (!copied.empty())
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploader.buffer);
+        for (PixelUpload &upload : copied)
+        {
+            // The texture may have died while its pixels were in transit.
+            if (*upload.wanted)
+            {
+                bindTexture(GL_TEXTURE0, GL_TEXTURE_2D, upload.texture);
+                glTexSubImage2D(
+                    GL_TEXTURE_2D, 0, 0, 0, upload.width, upload.height,
+                    upload.format, GL_UNSIGNED_BYTE, (GLvoid*)upload.offset);
+            }
+            upload.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            uploader.in_flight.push_back(upload);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    while (!uploader.in_flight.empty())
+    {
+        PixelUpload &upload = uploader.in_flight.front();
+        if (glClientWaitSync(upload.fence, 0, 0) == GL_TIMEOUT_EXPIRED) break;
+        glDeleteSync(upload.fence);
+        uploader.used -= upload.reserved;
+        uploader.pending--;
+        uploader.in_flight.pop_front();
+    }
+}
+
+TextureUploader::~TextureUploader()
+{
+    if (worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake_worker.notify_one();
+        worker.join();
+    }
+    if (!isContextActive()) return;
+    for (PixelUpload &upload : in_flight) glDeleteSync(upload.fence);
+    if (!buffer) return;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &buffer);
+}
+
+void watchFiles(FileWatcher *watcher)
+{
+#ifdef __linux__
+    alignas(inotify_event) char buffer[4096];
+    pollfd events {watcher->inotify_fd, POLLIN, 0};
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(watcher->mutex);
+            if (watcher->stopping) return;
+        }
+        // Wakes up now and then to notice stopping.
+        if (poll(&events, 1, 250) <= 0) continue;
+        ssize_t length = read(watcher->inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) continue;
+        std::vector<std::string> paths;
+        for (char *at = buffer; at < buffer + length;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event*>(at);
+            if (event->len) paths.push_back(packPath(watcher->watched[event->wd] + '/' + event->name));
+            at += sizeof(inotify_event) + event->len;
+        }
+        std::lock_guard<std::mutex> lock(watcher->mutex);
+        watcher->changed.insert(watcher->changed.end(), paths.begin(), paths.end());
+    }
+#else
+    std::map<std::string, std::filesystem::file_time_type> write_times;
+    // The first scan only learns what's already there.
+    bool first_scan = true;
+    auto scan = [&](std::vector<std::string> &paths)
+    {
+        std::error_code error;
+        for (const std::string &directory : watcher->directories)
+        {
+            for (auto it = std::filesystem::directory_iterator(directory, error);
+                 !error && it != std::filesystem::directory_iterator(); it.increment(error))
+            {
+                auto time = it->last_write_time(error);
+                if (error || !it->is_regular_file()) continue;
+                std::string path = packPath(it->path().string());
+                auto known = write_times.find(path);
+                if (known != write_times.end() && known->second == time) continue;
+                if (!first_scan) paths.push_back(path);
+                write_times[path] = time;
+            }
+        }
+        first_scan = false;
+    };
+    std::vector<std::string> paths;
+    scan(paths);
+    std::unique_lock<std::mutex> lock(watcher->mutex);
+    while (!watcher->wake.wait_for(lock, std::chrono::milliseconds(500), [&] { return watcher->stopping; }))
+    {
+        lock.unlock();
+        paths.clear();
+        scan(paths);
+        lock.lock();
+        watcher->changed.insert(watcher->changed.end(), paths.begin(), paths.end());
+    }
+#endif
+}
+
+Result<bool> startFileWatcher(FileWatcher &watcher, const std::vector<std::string> &directories)
+{
+    watcher.directories = directories;
+#ifdef __linux__
+    watcher.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher.inotify_fd < 0)
+        return errorResult<bool>(std::string("inotify: ") + std::strerror(errno));
+    for (const std::string &directory : directories)
+    {
+        // Editors that save by renaming a temporary file show up as IN_MOVED_TO.
+        int wd = inotify_add_watch(watcher.inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+            return errorResult<bool>("Could not watch " + directory + ": " + std::strerror(errno));
+        watcher.watched[wd] = directory;
+    }
+#endif
+    watcher.thread = std::thread(watchFiles, &watcher);
+    return successfulResult(true);
+}
+
+// Returns the files changed since the last call, each once.
+std::vector<std::string> takeChangedFiles(FileWatcher &watcher)
+{
+    std::vector<std::string> changed;
+    {
+        std::lock_guard<std::mutex> lock(watcher.mutex);
+        changed.swap(watcher.changed);
+    }
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    return changed;
+}
+
+FileWatcher::~FileWatcher()
+{
+    if (thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+    }
+#ifdef __linux__
+    if (inotify_fd >= 0) close(inotify_fd);
+#endif
+}
+
+// Reloads path with load whenever it changes. The path is in packPath form.
+void watchAsset(HotReloader &reloader, const std::string &path, ReloadLoad load)
+{
+    reloader.loaders[packPath(path)] = std::move(load);
+}
+
+// Call once per frame on the GL thread, before drawing. Starts loads for
+// watched files that changed and swaps in the ones that finished. A load
+// or swap that fails is reported and the old resource stays.
+void pumpReloads(HotReloader &reloader, ThreadPool &pool)
+{
+    for (const std::string &path : takeChangedFiles(reloader.watcher))
+    {
+        auto loader = reloader.loaders.find(path);
+        if (loader == reloader.loaders.end()) continue;
+        if (contains(reloader.in_flight, path)) reloader.stale.insert(path);
+        else reloader.in_flight.emplace(path, runAsync(pool, loader->second, "reload"));
+    }
+    for (auto it = reloader.in_flight.begin(); it != reloader.in_flight.end();)
+    {
+        if (it->second.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            ++it;
+            continue;
+        }
+        std::string path = it->first;
+        Result<ReloadApply> loaded = it->second.get();
+        it = reloader.in_flight.erase(it);
+        if (reloader.stale.erase(path))
+        {
+            reloader.in_flight.emplace(path, runAsync(pool, reloader.loaders[path], "reload"));
+            continue;
+        }
+        Result<bool> applied = loaded.success ? loaded.obj() : errorResult<bool>(loaded.error);
+        if (applied.success) std::cout << "Reloaded " << path << "\n";
+        else std::cerr << "Keeping the old " << path << ": " << applied.error << "\n";
+    }
+}
+
+PathMesh::PathMesh(MeshData &mesh_data)
+{
+    assert(mesh_data.primitive_type == MeshPrimitiveType::LINE_SEGMENTS);
+    data = std::move(mesh_data);
+    face_pairs.reserve(mesh_data.indices.size()/2);
+    // Assumption: faces are triangles.
+    // In the future this could be a parameter.
+    int face_sides = 3;
+    int indices_per_face = 2*face_sides;
+    for (int i = 0; i < mesh_data.indices.size(); i += indices_per_face)
+    {
+        int face_index = i/indices_per_face;
+        int line_beginning_index = i/face_sides;
+        for (int line = line_beginning_index; i < face_sides; i++)
+        {
+            if (face_pairs[line].first == 0)
+                face_pairs[line].first = face_index;
+            else if (face_pairs[line].second == 0)
+                face_pairs[line].second = face_index;
+            else assert(false); // three faces sharing a line? not possible.
+        };
+    }
+}
+
+void offset(PathMesh &path_mesh, glm::vec3 amount)
+{
+    auto &data = path_mesh.data.vertices;
+    auto stride = vertexStride(path_mesh.data);
+    for (int i = 0; i < data.size(); i += stride)
+    {
+        data[i+0] += amount.x;
+        data[i+1] += amount.y;
+        data[i+2] += amount.z;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // comic --build-pack [source dir] packs res/ for the next runs.
+    if (argc > 1 && std::string(argv[1]) == "--build-pack")
+    {
+        auto packResult = buildAssetPack(argc > 2 ? argv[2] : "res/", ASSET_PACK_PATH);
+        if (!packResult.success)
+        {
+            std::cerr << packResult.error << "\n";
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    // comic --assetc [source dir] fills the mesh and texture caches ahead of time.
+    if (argc > 1 && std::string(argv[1]) == "--assetc")
+    {
+        ThreadPool pool;
+        auto compileResult = compileAssets(pool, argc > 2 ? argv[2] : "res/");
+        if (!compileResult.success)
+        {
+            std::cerr << compileResult.error << "\n";
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    // Assets come from the pack when there is one, loose files otherwise.
+    if (std::filesystem::exists(ASSET_PACK_PATH))
+    {
+        auto packResult = openAssetPack(ASSET_PACK_PATH);
+        if (!packResult.success) std::cerr << packResult.error << "\n";
+    }
+
+    const std::string model_path = std::string(MESH_DIR) + "just_pyramid_ball.obj";
+    const std::string path_path = std::string(MESH_DIR) + "path.obj";
+    const std::string vertex_path = std::string(SHADER_DIR) + "test.vert";
+    const std::string fragment_path = std::string(SHADER_DIR) + "test.frag";
+    // Block compressed when the driver takes it.
+    TextureOptions model_texture_options;
+    model_texture_options.mip_filter = MipFilter::BOX;
+    model_texture_options.compress = true;
+
+    // Declared ahead of the pool, which runs its queued jobs on the way
+    // out, and those jobs may still reach for them.
+    BackgroundLoader loader;
+    std::mutex profile_mutex;
+    ThreadPool pool;
+    // comic --profile-jobs logs each job and frame as name, worker
+    // (-1 for the main thread), start and duration in milliseconds.
+    if (argc > 1 && std::string(argv[1]) == "--profile-jobs")
+    {
+        pool.profile_hook = [&profile_mutex](const char *name, int worker, double start_ms, double duration_ms)
+        {
+            std::lock_guard<std::mutex> lock(profile_mutex);
+            std::cerr << name << ',' << worker << ',' << start_ms << ',' << duration_ms << '\n';
+        };
+    }
+
+    // Parsing and decoding run on the pool while the window and GL
+    // context are created. The camera starts on the path, so that parse
+    // is waited for; everything else shows up whenever it's ready, and
+    // is drawn plain until its texture arrives.
+    auto path_future = runAsync(pool, [path_path]
+    {
+        return importOBJ(path_path, MeshPrimitiveType::LINE_SEGMENTS);
+    });
+
+    MeshArena arena;
+    ResourceCache resources;
+    TextureUploader uploader;
+
+    ArenaMesh model_mesh;
+    Material model_material;
+    std::shared_ptr<const Texture> model_texture;
+    HotReloader reloader;
+
+    bool mip_benchmark = argc > 1 && std::string(argv[1]) == "--mip-benchmark";
+    // The benchmark builds its own textures from the floor's pixels.
+    std::shared_ptr<Image> floor_texture_image;
+    std::unique_ptr<Texture> floor_texture;
+    Material floor_material;
+    loadInBackground(loader, loadImageAsync(pool, "slimy_vines.png"),
+        [&](Result<std::shared_ptr<Image>> &loaded)
+        {
+            if (!loaded.success)
+            {
+                std::cerr << loaded.error << "\n";
+                return;
+            }
+            std::shared_ptr<Image> &image = loaded.obj;
+            if (mip_benchmark) floor_texture_image = image;
+            floor_texture = std::make_unique<Texture>(startUpload(uploader, image));
+            floor_material.texture = floor_texture.get();
+        });
+
+    int screen_width = 1600; 
+    int screen_height = 900;
+
+    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_AUDIO);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+    SDL_DisplayMode display_mode;
+    SDL_GetCurrentDisplayMode(0, &display_mode);
+    // screen_width = display_mode.w;
+    // screen_height = display_mode.h;
+    SDL_Window *window = SDL_CreateWindow(
+        "Lego Island", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+        screen_width, screen_height, SDL_WINDOW_OPENGL);
+    if (!window)
+    {
+        std::cerr << "SDL error: " << SDL_GetError() << "\n";
+        return EXIT_FAILURE;
+    }
+    SDL_GLContext context = SDL_GL_CreateContext(window);
+    if (!context)
+    {
+        std::cerr << "SDL error: " << SDL_GetError() << "\n";
+        return EXIT_FAILURE;
+    }
+    context_active = true;
+    SDL_ShowCursor(0);
+
+    glewExperimental = GL_TRUE;
+    GLenum initStatus = glewInit();
     if (initStatus != GLEW_OK)
     {
         std::cerr << "Glew error: " << glewGetErrorString(initStatus) << "\n";
@@ -651,35 +4431,303 @@ int main(int argc, char *argv[])
     if (error != GL_NO_ERROR)
         std::cerr << "OpenGL error: " << gluErrorString(error) << "\n";
 
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_CULL_FACE);
+    setCapability(GL_DEPTH_TEST, true);
+    setCapability(GL_CULL_FACE, true);
+    // Rows of 1 to 3 channel images aren't padded to four bytes.
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (isParallelCompileSupported())
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+
+    {
+        auto uploaderResult = startTextureUploader(uploader, 64 << 20);
+        if (!uploaderResult.success)
+            std::cerr << "Uploading textures synchronously: " << uploaderResult.error << "\n";
+    }
 
-    Shader shader;
+    // The model's texture is whichever image its material chain settled
+    // on, so it's watched once the model has loaded.
+    auto watch_model_texture = [&](const std::string &name)
     {
-        auto shaderResult = makeShader(
-            loadFile("res/shaders/test.vert"),
-            loadFile("res/shaders/test.frag"));
-        if (!shaderResult.success)
+        watchAsset(reloader, std::string(IMAGE_DIR) + name, [&, name]() -> Result<ReloadApply>
         {
-            std::cerr << "Shader error: " << shaderResult.error << "\n";
-            return EXIT_FAILURE;
+            std::shared_ptr<Image> image = decodeImage(name);
+            if (!image->data) return errorResult<ReloadApply>("Could not decode " + image->path);
+            auto prepared = std::make_shared<PreparedTexture>(prepareTexture(*image, model_texture_options, &pool));
+            return successfulResult<ReloadApply>([&, name, image, prepared]() -> Result<bool>
+            {
+                auto textureResult = reloadTexture(resources, name, model_texture_options, image, *prepared);
+                if (!textureResult.success) return errorResult<bool>(textureResult.error);
+                model_texture = textureResult.obj;
+                model_material.texture = model_texture.get();
+                return successfulResult(true);
+            });
+        });
+    };
+
+    // Picking a codec asks GLEW what the driver takes, so the model, whose
+    // texture gets one, starts only now that GLEW is up.
+    loadInBackground(loader, loadModelAsync(pool, model_path, model_texture_options, "chinese_box.gif"),
+        [&](Result<ModelAsset> &loaded)
+        {
+            if (!loaded.success)
+            {
+                std::cerr << loaded.error << "\n";
+                return;
+            }
+            ModelAsset &model = loaded.obj;
+            model_mesh = add(arena, model.mesh);
+            if (!model.texture.image) return; // drawn untextured
+            auto textureResult = getTexture(
+                resources, model.texture.name, model_texture_options, model.texture.image, &model.texture.prepared);
+            if (!textureResult.success)
+            {
+                std::cerr << textureResult.error << "\n";
+                return;
+            }
+            model_texture = textureResult.obj;
+            model_material.texture = model_texture.get();
+            watch_model_texture(model.texture.name);
+            // Lets the pixels go now that they're on the GPU.
+            model.texture.image.reset();
+        });
+
+    glm::vec3 background_color {1.f, 0.2f, 0.f};
+    FrameConstantsBuffer frame_constants_buffer;
+
+    ShaderVariants shaders;
+    shaders.vertex_src = loadFile(vertex_path);
+    shaders.fragment_src = loadFile(fragment_path);
+    shaders.on_compiled = [&](Shader &shader, int features)
+    {
+        initTransformationMatrices(shader);
+        set(shader, BACKGROUND_COLOR_UNIFORM, background_color);
+        if (features & TEXTURED) setHasTexture(shader);
+    };
+    prepareVariant(shaders, TEXTURED);
+    prepareVariant(shaders, NO_FEATURES);
+    // Keep the window alive with a plain loading frame while the
+    // driver compiles and the path loads.
+    while (!areVariantsReady(shaders)
+        || path_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+        SDL_PumpEvents();
+        pumpLoads(loader);
+        glClearColor(0.2f, 0.2f, 0.2f, 1.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        SDL_GL_SwapWindow(window);
+    }
+    Shader *textured_shader = nullptr, *plain_shader = nullptr;
+    {
+        auto texturedResult = variant(shaders, TEXTURED);
+        auto plainResult = variant(shaders, NO_FEATURES);
+        for (auto *shaderResult : {&texturedResult, &plainResult})
+        {
+            if (!shaderResult->success)
+            {
+                std::cerr << "Shader error: " << shaderResult->error << "\n";
+                return EXIT_FAILURE;
+            }
         }
-        shader = std::move(shaderResult.obj);
+        textured_shader = texturedResult.obj;
+        plain_shader = plainResult.obj;
+    }
+
+    auto pathResult = path_future.get();
+    if (!pathResult.success)
+    {
+        std::cerr << pathResult.error << "\n";
+        return EXIT_FAILURE;
     }
+    PathMesh path_mesh {pathResult.obj};
+    MeshData normals_mesh_data = normalsMeshData(path_mesh.data);
+
+    ArenaMesh floor_mesh = add(arena, QUAD_MESH_DATA);
+
+    if (mip_benchmark)
+    {
+        finishLoads(loader);
+        if (!floor_texture_image) return EXIT_FAILURE;
+        auto benchResult = variant(shaders, TEXTURED | INSTANCED);
+        auto arrayResult = variant(shaders, TEXTURED | INSTANCED | TEXTURE_ARRAY);
+        for (auto *shaderResult : {&benchResult, &arrayResult})
+        {
+            if (!shaderResult->success)
+            {
+                std::cerr << "Shader error: " << shaderResult->error << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        Shader &bench_shader = *benchResult.obj;
+        Shader &array_shader = *arrayResult.obj;
+        // The same field again as one indirect command per quad, where
+        // the driver has multi-draw indirect.
+        Shader *batch_shader = nullptr;
+        if (isBatchingSupported())
+        {
+            auto batchResult = variant(shaders, TEXTURED | BATCHED);
+            if (!batchResult.success)
+            {
+                std::cerr << "Shader error: " << batchResult.error << "\n";
+                return EXIT_FAILURE;
+            }
+            batch_shader = batchResult.obj;
+        }
+        DrawBatcher bench_batcher;
+        InstanceStream bench_stream;
+        FrameConstants bench_constants;
+        bench_constants.view = glm::lookAt(glm::vec3(0.f), glm::vec3(0.f, -0.1f, -1.f), glm::vec3(0.f, 1.f, 0.f));
+        bench_constants.projection = glm::perspective(45.f, (float)screen_width / screen_height, 0.1f, 100.f);
+        bench_constants.background_color = background_color;
+        bench_constants.time = 0;
+        updateFrameConstants(frame_constants_buffer, bench_constants);
+        for (Shader *shader : {&bench_shader, &array_shader, batch_shader})
+        {
+            if (!shader) continue;
+            setCameraTransform(*shader, bench_constants.view);
+            setProjectionTransform(*shader, bench_constants.projection);
+        }
+        const int frames = 100;
+        for (auto filter : {MipFilter::NONE, MipFilter::BOX, MipFilter::KAISER})
+        {
+            MipChain mips = importMipChain(*floor_texture_image, filter);
+            Texture bench_texture {*floor_texture_image, &mips};
+            use(bench_shader);
+            double ms = timeMinifiedSampling([&](const glm::mat4 *models, GLsizei count)
+            {
+                drawInstanced(bench_stream, arena, floor_mesh, bench_texture, models, count);
+            }, frames);
+            // The same pixels as a one-layer array, for what sampling
+            // through sampler2DArray costs.
+            TextureArray bench_array {{floor_texture_image.get()}, filter};
+            use(array_shader);
+            double array_ms = timeMinifiedSampling([&](const glm::mat4 *models, GLsizei count)
+            {
+                std::vector<GLfloat> layers(count, 0.f);
+                drawInstanced(bench_stream, arena, floor_mesh, bench_array, models, layers.data(), count);
+            }, frames);
+            const char *name = filter == MipFilter::NONE ? "none" : filter == MipFilter::BOX ? "box" : "kaiser";
+            std::cout << "Mips: " << name << ", " << ms << " ms per frame, " << array_ms << " ms from an array";
+            if (batch_shader)
+            {
+                use(*batch_shader);
+                double batched_ms = timeMinifiedSampling([&](const glm::mat4 *models, GLsizei count)
+                {
+                    for (GLsizei i = 0; i < count; i++) submit(bench_batcher, floor_mesh, models[i]);
+                    bind(bench_texture);
+                    flush(bench_batcher, arena);
+                }, frames);
+                std::cout << ", " << batched_ms << " ms batched";
+            }
+            std::cout << "\n";
+        }
 
-    initTransformationMatrices(shader);
-    setColorUniform(shader, "background_color", glm::vec3(1.f, 0.2f, 0.f));
-    setHasTexture(shader);
+        // The floor alone on an atlas page, sampled the way an atlased
+        // material would be: box mips, texcoords moved into its cell.
+        auto atlasResult = buildAtlas({floor_texture_image.get()}, 4096, 4, 16);
+        MeshData atlas_quad_data = QUAD_MESH_DATA;
+        auto remapResult = atlasResult.success
+            ? remapTexcoords(atlas_quad_data, atlasResult.obj, 0)
+            : errorResult<bool>(atlasResult.error);
+        if (!remapResult.success) std::cerr << remapResult.error << "\n";
+        else
+        {
+            TextureAtlas &atlas = atlasResult.obj;
+            Image page {atlas.width, atlas.height, 4, atlas.pixels.data()};
+            MipChain page_mips = importMipChain(page, MipFilter::BOX);
+            Texture atlas_texture {page, &page_mips};
+            ArenaMesh atlas_quad = add(arena, atlas_quad_data);
+            use(bench_shader);
+            double ms = timeMinifiedSampling([&](const glm::mat4 *models, GLsizei count)
+            {
+                drawInstanced(bench_stream, arena, atlas_quad, atlas_texture, models, count);
+            }, frames);
+            std::cout << "Mips: box, " << ms << " ms per frame from an atlas page\n";
+        }
+        context_active = false;
+        SDL_GL_DeleteContext(context);
+        SDL_Quit();
+        return 0;
+    }
 
-    Mesh model_mesh {model_mesh_data};
-    Texture model_texture {model_texture_image};
+    ArenaMesh path_display_mesh = add(arena, path_mesh.data);
 
-    Mesh floor_mesh {QUAD_MESH_DATA};
-    Texture floor_texture {floor_texture_image};
+    ArenaMesh normals_mesh = add(arena, normals_mesh_data);
 
-    Mesh path_display_mesh {path_mesh.data};
+    // Falls back to drawing the normals out of the arena without it.
+    StreamRing stream_ring;
+    bool has_stream_ring = false;
+    {
+        auto ringResult = makeStreamRing(4 << 20);
+        if (ringResult.success)
+        {
+            stream_ring = std::move(ringResult.obj);
+            has_stream_ring = true;
+        }
+        else std::cerr << "Stream ring unavailable: " << ringResult.error << "\n";
+    }
 
-    Mesh normals_mesh {normals_mesh_data};
+    // Saving a model, shader or image under res/ swaps it in at the next
+    // frame. Not with a pack open, which the loaders would keep reading.
+    if (!asset_pack.entries)
+    {
+        auto watchResult = startFileWatcher(reloader.watcher, {MESH_DIR, SHADER_DIR, IMAGE_DIR});
+        if (!watchResult.success) std::cerr << "Hot reload unavailable: " << watchResult.error << "\n";
+    }
+    watchAsset(reloader, model_path, [&]() -> Result<ReloadApply>
+    {
+        auto importResult = importOBJ(model_path);
+        if (!importResult.success) return errorResult<ReloadApply>(importResult.error);
+        auto mesh_data = std::make_shared<MeshData>(std::move(importResult.obj));
+        return successfulResult<ReloadApply>([&, mesh_data]
+        {
+            ArenaMesh fresh = add(arena, *mesh_data);
+            if (model_mesh.id >= 0) remove(arena, model_mesh);
+            model_mesh = fresh;
+            return successfulResult(true);
+        });
+    });
+    watchAsset(reloader, path_path, [&]() -> Result<ReloadApply>
+    {
+        auto importResult = importOBJ(path_path, MeshPrimitiveType::LINE_SEGMENTS);
+        if (!importResult.success) return errorResult<ReloadApply>(importResult.error);
+        auto fresh_path = std::make_shared<PathMesh>(importResult.obj);
+        auto fresh_normals = std::make_shared<MeshData>(normalsMeshData(fresh_path->data));
+        return successfulResult<ReloadApply>([&, fresh_path, fresh_normals]
+        {
+            ArenaMesh display = add(arena, fresh_path->data);
+            ArenaMesh normals = add(arena, *fresh_normals);
+            remove(arena, path_display_mesh);
+            remove(arena, normals_mesh);
+            path_display_mesh = display;
+            normals_mesh = normals;
+            path_mesh = *fresh_path;
+            normals_mesh_data = *fresh_normals;
+            return successfulResult(true);
+        });
+    });
+    ReloadLoad reload_shaders = [&]() -> Result<ReloadApply>
+    {
+        return successfulResult<ReloadApply>(
+            [&, vertex_src = loadFile(vertex_path), fragment_src = loadFile(fragment_path)]
+            {
+                return reloadVariants(shaders, vertex_src, fragment_src);
+            });
+    };
+    watchAsset(reloader, vertex_path, reload_shaders);
+    watchAsset(reloader, fragment_path, reload_shaders);
+    watchAsset(reloader, std::string(IMAGE_DIR) + "slimy_vines.png", [&]() -> Result<ReloadApply>
+    {
+        std::shared_ptr<Image> image = decodeImage("slimy_vines.png");
+        if (!image->data) return errorResult<ReloadApply>("Could not decode " + image->path);
+        return successfulResult<ReloadApply>([&, image]
+        {
+            // Uploaded right away: the pixels don't outlive this call.
+            floor_texture = std::make_unique<Texture>(*image);
+            floor_material.texture = floor_texture.get();
+            return successfulResult(true);
+        });
+    });
 
     glm::vec3 model_pos {0.f, 1.f, -1.f};
     float model_rotation = 0, model_rotation_speed = -1.f;
@@ -695,12 +4743,14 @@ int main(int argc, char *argv[])
     int prev_mouse_x = screen_width/2, prev_mouse_y = screen_height/2;
     float previous_time = SDL_GetTicks() / 1000.f;
     float dt = 0;
+    float state_report_time = previous_time;
     bool wireframe = false;
     bool running = true;
     SDL_Event event;
 
     while (running)
     {
+        ProfileScope frame_scope(pool, "frame");
         float now = SDL_GetTicks() / 1000.f;
         dt = now - previous_time;
         previous_time = now;
@@ -769,33 +4819,77 @@ int main(int argc, char *argv[])
             eye_pos += world_space_movement;
         }
 
+        pumpLoads(loader);
+        pumpReloads(reloader, pool);
+        if (has_stream_ring) beginFrame(stream_ring);
+        pumpUploads(uploader);
+
         glClearColor(0.9f, 0.9f, 0.9f, 1.f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glLineWidth(2);
         glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
 
-        use(shader);
-        setCameraTransform(shader, glm::lookAt(eye_pos + eye_raised, eye_pos + eye_raised + eye_look_direction, glm::vec3(0.f, 1.f, 0.f)));
-        setProjectionTransform(shader, glm::perspective(45.f, (float)screen_width / screen_height, 0.1f, 100.f));
+        FrameConstants frame_constants;
+        frame_constants.view = glm::lookAt(eye_pos + eye_raised, eye_pos + eye_raised + eye_look_direction, glm::vec3(0.f, 1.f, 0.f));
+        frame_constants.projection = glm::perspective(45.f, (float)screen_width / screen_height, 0.1f, 100.f);
+        frame_constants.background_color = background_color;
+        frame_constants.time = now;
+        if (!has_stream_ring || !updateFrameConstants(stream_ring, frame_constants))
+            updateFrameConstants(frame_constants_buffer, frame_constants);
 
-        glm::mat4 model = glm::translate(glm::mat4(1.0f), model_pos);
-        model = glm::scale(model, glm::vec3(3.f, 3.f, 3.f));
-        // model = glm::rotate(model, model_rotation, glm::vec3(0.f, 1.f, 0.f));
-        setModelTransform(shader, model);
-        glEnable(GL_CULL_FACE);
-        draw(model_mesh, model_texture);
+        // Shaders without the shared block still take these one by one.
+        for (auto &features_and_shader : shaders.compiled)
+        {
+            Shader &shader = features_and_shader.second;
+            if (shader.frame_constants_block != GL_INVALID_INDEX) continue;
+            setCameraTransform(shader, frame_constants.view);
+            setProjectionTransform(shader, frame_constants.projection);
+        }
+
+        // Until its load finishes there's nothing to draw.
+        if (model_mesh.id >= 0)
+        {
+            glm::mat4 model = glm::translate(glm::mat4(1.0f), model_pos);
+            model = glm::scale(model, glm::vec3(3.f, 3.f, 3.f));
+            // model = glm::rotate(model, model_rotation, glm::vec3(0.f, 1.f, 0.f));
+            int features = shaderFeatures(model_material);
+            Shader &model_shader = variantOr(shaders, features, features & TEXTURED ? *textured_shader : *plain_shader);
+            setModelTransform(model_shader, model);
+            setCapability(GL_CULL_FACE, true);
+            draw(arena, model_mesh, model_material);
+        }
 
-        setModelTransform(shader, glm::mat4(1.0f));
-        glDisable(GL_CULL_FACE);
-        bind(floor_texture);
-        glBindVertexArray(path_display_mesh.vao);
-        glDrawElements(GL_LINES, static_cast<GLsizei>(path_display_mesh.num_vertices), GL_UNSIGNED_INT, 0);
+        int path_features = shaderFeatures(floor_material);
+        Shader &path_shader = variantOr(shaders, path_features, path_features & TEXTURED ? *textured_shader : *plain_shader);
+        setModelTransform(path_shader, glm::mat4(1.0f));
+        setCapability(GL_CULL_FACE, false);
+        draw(arena, path_display_mesh, floor_material);
 
-        glBindVertexArray(normals_mesh.vao);
-        glDrawArrays(GL_LINES, 0, normals_mesh_data.vertices.size()/2);
+        setModelTransform(*plain_shader, glm::mat4(1.0f));
+        // A reloaded path can outgrow the ring's section; the arena copy
+        // is always there.
+        if (!has_stream_ring || !drawLines(stream_ring, normals_mesh_data))
+            draw(arena, normals_mesh);
 
+        if (has_stream_ring) endFrame(stream_ring);
         SDL_GL_SwapWindow(window);
 
+        GLStateCounters state_counters = takeStateCounters();
+        if (now - state_report_time >= 1.f)
+        {
+            state_report_time = now;
+            std::vector<float> utilization = takeWorkerUtilization(pool);
+            float busy = 0;
+            for (float worker : utilization) busy += worker;
+            busy /= std::max<size_t>(utilization.size(), 1);
+            std::string title =
+                "Lego Island (state changes: "
+                + std::to_string(state_counters.issued) + " issued, "
+                + std::to_string(state_counters.elided) + " elided per frame; workers "
+                + std::to_string(static_cast<int>(busy * 100 + 0.5f)) + "% busy)";
+            SDL_SetWindowTitle(window, title.c_str());
+        }
+
         GLenum error = glGetError();
         if (error != GL_NO_ERROR)
         {
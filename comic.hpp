@@ -7,8 +7,41 @@
 #include <functional>
 #include <memory>
 #include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <filesystem>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <set>
+#include <future>
+#include <utility>
+#include <coroutine>
 #include <cctype>
 #include <cassert>
+#include <cmath>
+#include <climits>
+#include <cstddef>
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#endif
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -17,16 +50,44 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/constants.hpp>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COMIC_SSE 1
+#include <emmintrin.h>
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
-constexpr char *IMAGE_DIR = "res/images/";
-constexpr char *MESH_DIR  = "res/models/";
+constexpr const char *IMAGE_DIR = "res/images/";
+constexpr const char *MESH_DIR  = "res/models/";
+constexpr const char *SHADER_DIR = "res/shaders/";
+constexpr const char *SHADER_CACHE_DIR = "cache/shaders/";
+constexpr const char *MIP_CACHE_DIR = "cache/mips/";
+constexpr const char *COMPRESSED_CACHE_DIR = "cache/compressed/";
+constexpr const char *MESH_CACHE_DIR = "cache/meshes/";
+constexpr const char *ASSET_PACK_PATH = "res.pack";
+
+struct GLStateCounters
+{
+    int issued = 0;
+    int elided = 0;
+};
+
+// Shadow copy of the GL state we change often, so binds and toggles
+// that wouldn't change anything never reach the driver.
+struct GLState
+{
+    GLuint program = 0;
+    GLuint vertex_array = 0;
+    GLenum active_texture = GL_TEXTURE0;
+    std::map<std::pair<GLenum, GLenum>, GLuint> textures;
+    std::map<GLenum, bool> capabilities;
+    GLStateCounters counters;
+};
 
 template <typename T>
 struct Result
 {
-    T obj;
+    T obj {};
     bool success = true;
     std::string error = "";
 };
@@ -100,6 +161,250 @@ struct Mesh
     ~Mesh();
 };
 
+// Handle to a mesh living in a MeshArena. It stays valid when the
+// arena grows or compacts; only the offsets behind it move.
+struct ArenaMesh
+{
+    int id = -1;
+};
+
+struct ArenaRange
+{
+    GLsizei offset;
+    GLsizei count;
+};
+
+struct ArenaAllocation
+{
+    char layout = MeshLayout::NONE;
+    MeshPrimitiveType primitive_type = MeshPrimitiveType::TRIANGLES;
+    GLint base_vertex = 0;
+    GLsizei num_vertices = 0;
+    GLsizei first_index = 0;
+    GLsizei num_indices = 0;
+    bool live = false;
+};
+
+// One big vertex buffer and index buffer for every mesh of a given layout.
+// Capacities and offsets are counted in vertices and indices, not bytes.
+struct ArenaPool
+{
+    GLuint vao = 0, vbo = 0, ibo = 0;
+    char layout = MeshLayout::NONE;
+    GLsizei vertex_capacity = 0, index_capacity = 0;
+    GLsizei vertex_top = 0, index_top = 0;
+    std::vector<ArenaRange> free_vertices;
+    std::vector<ArenaRange> free_indices;
+};
+
+struct MeshArena
+{
+    std::map<char, ArenaPool> pools;
+    std::vector<ArenaAllocation> allocations;
+    std::vector<int> free_ids;
+
+    MeshArena() = default;
+
+    MeshArena(const MeshArena &other) = delete;
+    MeshArena& operator=(const MeshArena &other) = delete;
+
+    ~MeshArena();
+};
+
+// Matches the layout glMultiDrawElementsIndirect reads.
+struct DrawElementsIndirectCommand
+{
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint base_instance;
+};
+
+constexpr GLuint BATCH_DRAW_ID_ATTRIBUTE = 7;
+constexpr GLuint BATCH_MODELS_BINDING = 0;
+
+struct BatchRequest
+{
+    ArenaMesh mesh;
+    glm::mat4 model;
+};
+
+// Collects draws of arena meshes for a frame and issues them as one
+// glMultiDrawElementsIndirect per layout and primitive type.
+// Shaders used with it read their model matrix from the shader storage
+// block at BATCH_MODELS_BINDING, indexed by the per-draw attribute at
+// BATCH_DRAW_ID_ATTRIBUTE:
+//     layout(location = 7) in uint draw_id;
+//     layout(std430, binding = 0) readonly buffer DrawModels { mat4 draw_models[]; };
+struct DrawBatcher
+{
+    GLuint command_buffer = 0, model_buffer = 0, draw_id_buffer = 0;
+    GLsizei capacity = 0;
+    std::vector<BatchRequest> requests;
+    std::vector<DrawElementsIndirectCommand> commands;
+    std::vector<glm::mat4> models;
+    std::vector<GLuint> prepared_vaos;
+    int batches_last_flush = 0;
+
+    DrawBatcher() = default;
+
+    DrawBatcher(const DrawBatcher &other) = delete;
+    DrawBatcher& operator=(const DrawBatcher &other) = delete;
+
+    ~DrawBatcher();
+};
+
+// Shaders drawing instances take their model matrix from
+//     layout(location = 8) in mat4 instance_model;
+// which occupies locations 8 through 11.
+constexpr GLuint INSTANCE_MODEL_ATTRIBUTE = 8;
+// With a TextureArray, the layer each instance samples comes from
+//     layout(location = 12) in float instance_layer;
+constexpr GLuint INSTANCE_LAYER_ATTRIBUTE = 12;
+
+// Per-instance data written front to back each frame. When it runs out
+// the buffer is orphaned, so writes never wait on draws still in flight.
+struct InstanceStream
+{
+    GLuint buffer = 0;
+    GLsizeiptr capacity = 0;
+    GLsizeiptr offset = 0;
+
+    InstanceStream() = default;
+
+    InstanceStream(const InstanceStream &other) = delete;
+    InstanceStream& operator=(const InstanceStream &other) = delete;
+
+    ~InstanceStream();
+};
+
+constexpr int STREAM_RING_FRAMES = 3;
+
+// A persistently mapped buffer split into one section per frame in flight.
+// Writes are plain memcpys into mapped memory; a fence per section keeps
+// the CPU from overwriting data the GPU hasn't consumed yet.
+struct StreamRing
+{
+    GLuint buffer = 0;
+    GLuint lines_vao = 0;
+    char *mapped = nullptr;
+    GLsizeiptr frame_size = 0;
+    GLsizeiptr alignment = 16;
+    GLsizeiptr offset = 0;
+    int frame = 0;
+    std::array<GLsync, STREAM_RING_FRAMES> fences = {};
+
+    StreamRing() = default;
+
+    StreamRing(const StreamRing &other) = delete;
+    StreamRing& operator=(const StreamRing &other) = delete;
+
+    StreamRing(StreamRing &&other)
+    {
+        moveHere(other);
+    }
+
+    StreamRing &operator=(StreamRing &&other)
+    {
+        moveHere(other);
+        return *this;
+    }
+
+    ~StreamRing();
+
+private:
+
+    void moveHere(StreamRing &other)
+    {
+        buffer = other.buffer;
+        lines_vao = other.lines_vao;
+        mapped = other.mapped;
+        frame_size = other.frame_size;
+        alignment = other.alignment;
+        offset = other.offset;
+        frame = other.frame;
+        fences = other.fences;
+        other.buffer = 0;
+        other.lines_vao = 0;
+        other.mapped = nullptr;
+        other.fences = {};
+    }
+};
+
+constexpr GLuint FRAME_CONSTANTS_BINDING = 0;
+constexpr const char *FRAME_CONSTANTS_BLOCK = "FrameConstants";
+
+// Mirrors the std140 block shared by every shader:
+//     layout(std140) uniform FrameConstants
+//     {
+//         mat4 view;
+//         mat4 projection;
+//         vec3 background_color;
+//         float time;
+//     };
+struct FrameConstants
+{
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::vec3 background_color;
+    float time;
+};
+
+// std140: mat4 is four vec4 columns, and a float may fill the tail of a vec3.
+static_assert(offsetof(FrameConstants, view) == 0, "std140 mismatch");
+static_assert(offsetof(FrameConstants, projection) == 64, "std140 mismatch");
+static_assert(offsetof(FrameConstants, background_color) == 128, "std140 mismatch");
+static_assert(offsetof(FrameConstants, time) == 140, "std140 mismatch");
+static_assert(sizeof(FrameConstants) == 144, "std140 mismatch");
+
+struct FrameConstantsBuffer
+{
+    GLuint buffer = 0;
+
+    FrameConstantsBuffer() = default;
+
+    FrameConstantsBuffer(const FrameConstantsBuffer &other) = delete;
+    FrameConstantsBuffer& operator=(const FrameConstantsBuffer &other) = delete;
+
+    ~FrameConstantsBuffer();
+};
+
+// FNV-1a. constexpr so uniform names used in code hash at compile time.
+constexpr std::uint32_t hashName(const char *name, std::uint32_t hash = 2166136261u)
+{
+    return *name ? hashName(name + 1, (hash ^ static_cast<unsigned char>(*name)) * 16777619u) : hash;
+}
+
+// Value of a sampler uniform: the texture unit it reads from.
+struct Sampler
+{
+    GLint unit;
+};
+
+// A uniform name bound to the C++ type it is set with.
+template <typename T>
+struct Uniform
+{
+    const char *name;
+    std::uint32_t hash;
+
+    constexpr Uniform(const char *name) : name(name), hash(hashName(name)) {}
+};
+
+constexpr Uniform<glm::mat4> MODEL_UNIFORM {"model"};
+constexpr Uniform<glm::mat4> VIEW_UNIFORM {"view"};
+constexpr Uniform<glm::mat4> PROJECTION_UNIFORM {"projection"};
+constexpr Uniform<glm::vec3> BACKGROUND_COLOR_UNIFORM {"background_color"};
+constexpr Uniform<Sampler> TEX_UNIFORM {"tex"};
+
+struct UniformInfo
+{
+    GLint location;
+    GLenum type;
+    GLint size;
+};
+
 struct Shader
 {
     GLuint id;
@@ -110,6 +415,12 @@ struct Shader
     GLint _view;
     GLint _projection;
 
+    // GL_INVALID_INDEX when the program doesn't declare FrameConstants.
+    GLuint frame_constants_block = GL_INVALID_INDEX;
+
+    // Every active uniform outside a block, keyed by hashName of its name.
+    std::unordered_map<std::uint32_t, UniformInfo> uniforms;
+
     Shader() : id(0), vertex(0), fragment(0) {}
 
     Shader(const Shader &other) = delete;
@@ -138,27 +449,227 @@ private:
         _model = other._model;
         _view = other._view;
         _projection = other._projection;
+        frame_constants_block = other.frame_constants_block;
+        uniforms = std::move(other.uniforms);
         other.id = 0;
         other.vertex = 0;
         other.fragment = 0;
     }
 };
 
+// A program handed to the driver by startShaderBuild but not yet checked.
+struct ShaderBuild
+{
+    Shader shader;
+    std::string cache_path;
+    bool from_cache = false;
+};
+
+// Compile-time switches for shader sources. Each set bit becomes a
+// #define of the same name ahead of the source.
+enum ShaderFeature
+{
+    NO_FEATURES = 0,
+    TEXTURED = 1 << 0,
+    INSTANCED = 1 << 1, // model matrix from the instance_model attribute
+    TEXTURE_ARRAY = 1 << 2, // tex is a sampler2DArray indexed by instance_layer
+    BATCHED = 1 << 3,   // model matrix from DrawBatcher's storage block
+};
+
+// One pair of sources, compiled into a specialized program per feature
+// combination the first time that combination is asked for.
+struct ShaderVariants
+{
+    std::string vertex_src;
+    std::string fragment_src;
+    std::map<int, Shader> compiled;
+    std::map<int, ShaderBuild> pending;
+    // Compile errors by features, so a broken variant isn't rebuilt on
+    // every request. Cleared when the sources change.
+    std::map<int, std::string> failed;
+    // Per-program setup, like constant uniforms.
+    std::function<void(Shader &shader, int features)> on_compiled;
+};
+
+// A read-only view of a whole file, mapped into memory.
+struct MappedFile
+{
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+    MappedFile() = default;
+
+    MappedFile(const MappedFile &other) = delete;
+    MappedFile& operator=(const MappedFile &other) = delete;
+
+    MappedFile(MappedFile &&other)
+    {
+        moveHere(other);
+    }
+
+    MappedFile &operator=(MappedFile &&other)
+    {
+        moveHere(other);
+        return *this;
+    }
+
+    ~MappedFile();
+
+private:
+
+    void moveHere(MappedFile &other)
+    {
+        data = other.data;
+        size = other.size;
+        other.data = nullptr;
+        other.size = 0;
+#ifdef _WIN32
+        file = other.file;
+        mapping = other.mapping;
+        other.file = INVALID_HANDLE_VALUE;
+        other.mapping = nullptr;
+#endif
+    }
+};
+
+// Every file under res/ in one file, so a cold start maps a single file
+// and reads it front to back instead of opening each asset. Laid out as
+// a PackHeader, the index sorted by path hash, the path strings, then
+// the payloads, each starting on a PACK_ALIGNMENT boundary.
+constexpr std::uint32_t PACK_MAGIC = 0x4b504d43; // "CMPK"
+constexpr std::uint32_t PACK_VERSION = 1;
+constexpr std::uint64_t PACK_ALIGNMENT = 64;
+
+enum class PackCompression : std::uint32_t
+{
+    NONE,
+    LZ,
+};
+
+struct PackHeader
+{
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t num_entries;
+    std::uint32_t paths_size;
+};
+
+struct PackEntry
+{
+    std::uint64_t path_hash;
+    // Hash of the unpacked bytes, standing in for a file's modification
+    // time in the keys of derived caches.
+    std::uint64_t content_hash;
+    std::uint64_t offset;
+    std::uint64_t stored_size;
+    std::uint64_t size;
+    std::uint32_t path_offset;
+    std::uint32_t path_length;
+    PackCompression compression;
+    std::uint32_t reserved;
+};
+static_assert(sizeof(PackHeader) == 16, "PackHeader is read straight from the file");
+static_assert(sizeof(PackEntry) == 56, "PackEntry is read straight from the file");
+
+struct AssetPack
+{
+    MappedFile file;
+    const PackEntry *entries = nullptr;
+    std::uint32_t num_entries = 0;
+    const char *paths = nullptr;
+};
+
 struct Image
 {
+    std::string path;
     unsigned char *data;
+    // Whether data came from stb and can be given back with freePixels.
+    bool owns_data = false;
     int width;
     int height;
     int channels;
+    // Hash of the encoded file. Left 0 until contentHash first needs it,
+    // and for pixels that didn't come from a file.
+    mutable std::uint64_t content_hash = 0;
+    // Whether a loose file at path can be hashed later, and when it was
+    // last written as of decoding, to catch it changing in between.
+    bool from_file = false;
+    std::filesystem::file_time_type source_time {};
 
     Image(const char *filename);
+    // Decodes an encoded file already in memory, read from path.
+    Image(const std::string &path, const unsigned char *bytes, size_t size);
+    // Wraps pixels owned by someone else, like an atlas.
+    Image(int width, int height, int channels, unsigned char *data);
+};
+
+struct AtlasRect
+{
+    int x, y;
+    int width, height;
+};
+
+// Many small images packed into one RGBA8 page. placements[i] is where
+// the i-th input image landed, not counting its gutter. Only
+// --mip-benchmark builds one: the scene has two textures, one of them
+// block-compressed and hot-reloaded on its own, which a shared RGBA8
+// page would undo to save a single bind.
+struct TextureAtlas
+{
+    int width = 0, height = 0;
+    std::vector<unsigned char> pixels;
+    std::vector<AtlasRect> placements;
+};
+
+enum class MipFilter { NONE, BOX, KAISER };
+
+// Mip levels below the base image, halving down to 1x1, with as many
+// 8-bit channels as the image they came from.
+struct MipLevel
+{
+    int width;
+    int height;
+    std::vector<unsigned char> pixels;
+};
+
+struct MipChain
+{
+    MipFilter filter = MipFilter::NONE;
+    int channels = 4;
+    std::vector<MipLevel> levels;
+};
+
+enum class TextureCodec { BC1, BC3, BC7 };
+
+// A block-compressed image with its mip levels, base level first.
+struct CompressedLevel
+{
+    int width;
+    int height;
+    std::vector<unsigned char> blocks;
+};
+
+struct CompressedImage
+{
+    TextureCodec codec = TextureCodec::BC1;
+    std::vector<CompressedLevel> levels;
 };
 
 struct Texture
 {
     GLuint id;
+    // Shared with a startUpload still in transit; cleared when the
+    // texture dies so pumpUploads drops the pixels instead of writing
+    // them into whatever texture reuses the name.
+    std::shared_ptr<bool> upload_wanted;
 
-    Texture(const Image &image);
+    // With mips the full chain is uploaded and sampled trilinearly.
+    Texture(const Image &image, const MipChain *mips = nullptr);
+    Texture(const CompressedImage &image);
 
     Texture(const Texture &other) = delete;
     Texture& operator=(const Texture &other) = delete;
@@ -166,12 +677,14 @@ struct Texture
     Texture(Texture &&other)
     {
         id = other.id;
+        upload_wanted = std::move(other.upload_wanted);
         other.id = 0;
     }
 
     Texture &operator=(Texture &&other)
     {
         id = other.id;
+        upload_wanted = std::move(other.upload_wanted);
         other.id = 0;
         return *this;
     }
@@ -179,6 +692,388 @@ struct Texture
     ~Texture();
 };
 
+// Same-sized images as the layers of one GL_TEXTURE_2D_ARRAY, so draws
+// using different images don't need a texture bind between them.
+// Layers are uncompressed, so the scene's compressed model texture
+// can't share one with the floor; only --mip-benchmark uses it.
+struct TextureArray
+{
+    GLuint id = 0;
+    int width = 0, height = 0;
+    int layers = 0;
+
+    TextureArray(const std::vector<const Image*> &images, MipFilter mip_filter = MipFilter::NONE);
+
+    TextureArray(const TextureArray &other) = delete;
+    TextureArray& operator=(const TextureArray &other) = delete;
+
+    TextureArray(TextureArray &&other)
+    {
+        id = other.id;
+        width = other.width;
+        height = other.height;
+        layers = other.layers;
+        other.id = 0;
+    }
+
+    TextureArray &operator=(TextureArray &&other)
+    {
+        id = other.id;
+        width = other.width;
+        height = other.height;
+        layers = other.layers;
+        other.id = 0;
+        return *this;
+    }
+
+    ~TextureArray();
+};
+
+struct PixelUpload
+{
+    GLuint texture = 0;
+    std::shared_ptr<bool> wanted;
+    GLenum format = GL_RGBA;
+    int width = 0, height = 0;
+    // Held until the worker has copied the pixels into the ring.
+    std::shared_ptr<const Image> image;
+    GLsizeiptr offset = 0;
+    GLsizeiptr size = 0;
+    // Bytes this upload holds in the ring, including any skipped at the end.
+    GLsizeiptr reserved = 0;
+    GLsync fence = nullptr;
+};
+
+// Streams pixels to textures through a persistently mapped pixel unpack
+// buffer. A worker thread copies decoded pixels into the mapped ring and
+// the GL thread turns finished copies into glTexSubImage2D calls. A
+// fence per upload releases its part of the ring.
+struct TextureUploader
+{
+    GLuint buffer = 0;
+    unsigned char *mapped = nullptr;
+    GLsizeiptr capacity = 0;
+    GLsizeiptr head = 0;
+    GLsizeiptr used = 0;
+
+    // Shared with the worker, guarded by mutex.
+    std::deque<PixelUpload> to_copy;
+    std::deque<PixelUpload> copied;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wake_worker;
+    std::thread worker;
+
+    // GL thread only.
+    std::deque<PixelUpload> in_flight;
+    int pending = 0;
+
+    TextureUploader() = default;
+
+    TextureUploader(const TextureUploader &other) = delete;
+    TextureUploader& operator=(const TextureUploader &other) = delete;
+
+    ~TextureUploader();
+};
+
+struct Material
+{
+    const Texture *texture = nullptr;
+};
+
+// Work outstanding under a job: spawning with a counter adds to it and
+// finishing takes away, so waiting on it waits for all of its children.
+struct JobCounter
+{
+    std::atomic<int> unfinished {0};
+};
+
+struct Job
+{
+    std::function<void()> run;
+    JobCounter *counter = nullptr;
+    const char *name = "job";
+};
+
+struct WorkerQueue
+{
+    std::deque<Job> jobs;
+    std::mutex mutex;
+};
+
+// Told about every job and ProfileScope: its name, the worker it ran on
+// (-1 off the pool), and when, in milliseconds since the pool started.
+// Called from the workers at the same time, so it has to be thread safe.
+using ProfileHook = std::function<void(const char *name, int worker, double start_ms, double duration_ms)>;
+
+// A work-stealing scheduler. Each worker runs the newest job off its own
+// deque and, when that's empty, steals the oldest from another's, so
+// children run where their parent left its data while idle workers
+// still find something to do. Jobs spawned from outside the pool are
+// dealt out round robin.
+struct ThreadPool
+{
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::atomic<int> queued {0};
+    std::atomic<unsigned> next_queue {0};
+
+    // Guards stopping; sleeping workers wait on wake_worker, and wait()
+    // callers on wake_waiter for new jobs or a counter reaching zero.
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wake_worker;
+    std::condition_variable wake_waiter;
+
+    // Time each worker spent in jobs since takeWorkerUtilization last ran.
+    std::unique_ptr<std::atomic<long long>[]> busy_ns;
+    // When each worker's running job started or was last sampled, in ns
+    // since started; -1 while idle. Lets long jobs count as they go.
+    std::unique_ptr<std::atomic<long long>[]> running_since_ns;
+    std::chrono::steady_clock::time_point started, utilization_since;
+    ProfileHook profile_hook;
+
+    ThreadPool(int num_threads = std::max(1u, std::thread::hardware_concurrency()));
+
+    ThreadPool(const ThreadPool &other) = delete;
+    ThreadPool& operator=(const ThreadPool &other) = delete;
+
+    ~ThreadPool();
+};
+
+// Reports how long it was alive to the pool's profile hook, if it has one.
+struct ProfileScope
+{
+    ThreadPool &pool;
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+
+    ProfileScope(ThreadPool &pool, const char *name);
+    ~ProfileScope();
+};
+
+// A coroutine producing a T. Nothing runs until it is first awaited, and
+// the awaiter resumes on whatever thread the task finished on.
+template <typename T>
+struct Task
+{
+    struct promise_type
+    {
+        T value;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept
+        {
+            struct ResumeAwaiter
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+                {
+                    std::coroutine_handle<> continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return ResumeAwaiter();
+        }
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(const Task &other) = delete;
+    Task &operator=(const Task &other) = delete;
+    Task(Task &&other) : handle(other.handle) { other.handle = nullptr; }
+    Task &operator=(Task &&other)
+    {
+        std::swap(handle, other.handle);
+        return *this;
+    }
+    ~Task() { if (handle) handle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() { return std::move(handle.promise().value); }
+};
+
+// A coroutine nobody awaits. It starts right away and frees itself when
+// it finishes.
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// A suspended coroutine waiting in a job queue. If the job is dropped
+// without running, as at shutdown, the coroutine is destroyed with it
+// instead of leaking its frame.
+struct PendingResume
+{
+    std::coroutine_handle<> handle;
+
+    explicit PendingResume(std::coroutine_handle<> handle) : handle(handle) {}
+
+    PendingResume(const PendingResume &other) = delete;
+    PendingResume& operator=(const PendingResume &other) = delete;
+
+    ~PendingResume() { if (handle) handle.destroy(); }
+};
+
+// Jobs for the GL thread, pushed from any thread and run by the GL
+// thread alone. Lock-free: producers swap their node in at the head and
+// the consumer walks from the tail (Vyukov's MPSC queue), so a worker
+// finishing a load never waits on a frame in progress.
+struct GLJobQueue
+{
+    struct Node
+    {
+        std::function<void()> job;
+        std::atomic<Node*> next {nullptr};
+    };
+
+    std::atomic<Node*> head;
+    Node *tail; // GL thread only
+    Node stub;
+
+    GLJobQueue() : head(&stub), tail(&stub) {}
+
+    GLJobQueue(const GLJobQueue &other) = delete;
+    GLJobQueue& operator=(const GLJobQueue &other) = delete;
+
+    ~GLJobQueue();
+};
+
+// Loads whose CPU half runs on the pool and whose GL half waits in
+// gl_jobs for the render thread, which spends at most frame_budget_ms
+// a frame on them.
+struct BackgroundLoader
+{
+    // Started and not yet finished on the GL thread. Ahead of gl_jobs so
+    // it outlives the loads that queue drops when destroyed.
+    std::atomic<int> outstanding {0};
+    GLJobQueue gl_jobs;
+    double frame_budget_ms = 2.0;
+};
+
+struct TextureOptions
+{
+    MipFilter mip_filter = MipFilter::NONE;
+    bool compress = false;
+};
+
+// The CPU half of getTexture, which can run off the GL thread.
+struct PreparedTexture
+{
+    bool compressed = false;
+    CompressedImage blocks;
+    MipChain mips;
+};
+
+// A texture decoded and prepared on the pool, waiting for getTexture.
+struct TextureAsset
+{
+    // Under IMAGE_DIR, and the texture's key in the resource cache.
+    std::string name;
+    std::shared_ptr<Image> image;
+    PreparedTexture prepared;
+};
+
+// A model with the texture its material names, everything but the GL
+// half done.
+struct ModelAsset
+{
+    MeshData mesh;
+    TextureAsset texture;
+};
+
+struct ResourceCounters
+{
+    int hits = 0;
+    int misses = 0;
+    int evictions = 0;
+};
+
+struct CachedResource
+{
+    std::shared_ptr<Image> image;
+    std::shared_ptr<Texture> texture;
+    size_t cpu_bytes = 0;
+    size_t gpu_bytes = 0;
+    std::list<std::string>::iterator lru_position;
+};
+
+// Owns decoded images and textures by path and load options. Whoever
+// asks gets a shared reference; entries nobody else references are
+// evicted, least recently used first, once either budget is exceeded.
+struct ResourceCache
+{
+    size_t cpu_budget = 256 << 20;
+    size_t gpu_budget = 512 << 20;
+    size_t cpu_used = 0;
+    size_t gpu_used = 0;
+    std::unordered_map<std::string, CachedResource> entries;
+    std::list<std::string> lru; // most recently used first
+    ResourceCounters counters;
+};
+
+// Collects files written or moved into a set of directories, on a
+// thread of its own: inotify on Linux, comparing modification times
+// twice a second elsewhere. Paths are in packPath form.
+struct FileWatcher
+{
+    std::vector<std::string> directories;
+    std::thread thread;
+
+    // Shared with the thread, guarded by mutex.
+    std::vector<std::string> changed;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+
+#ifdef __linux__
+    int inotify_fd = -1;
+    std::map<int, std::string> watched; // watch descriptor to directory
+#endif
+
+    FileWatcher() = default;
+
+    FileWatcher(const FileWatcher &other) = delete;
+    FileWatcher& operator=(const FileWatcher &other) = delete;
+
+    ~FileWatcher();
+};
+
+// Swaps a reloaded resource in. Runs on the GL thread between frames.
+using ReloadApply = std::function<Result<bool>()>;
+// The CPU side of a reload, run on the pool; hands back the swap.
+using ReloadLoad = std::function<Result<ReloadApply>()>;
+
+struct HotReloader
+{
+    FileWatcher watcher;
+    std::unordered_map<std::string, ReloadLoad> loaders; // by watched file
+    std::map<std::string, std::future<Result<ReloadApply>>> in_flight;
+    // Changed again while loading, so the load in flight is out of date.
+    std::set<std::string> stale;
+};
+
 struct PathMesh
 {
     MeshData data;